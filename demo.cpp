@@ -1,3 +1,4 @@
+#include "src/dual.hpp"
 #include "src/variable.hpp"
 
 #include <cassert>
@@ -33,5 +34,12 @@ int main() {
     assert(abs((vx + vy + vz) - num_diff(g<double>, eps, x0, y0, z0)) < eqeps);
     x.clear(), y.clear(), z.clear();
 
+    // forward mode: one evaluation gives the derivatives along all three inputs
+    using dual = Dual<double, 3>;
+    auto w = f(dual::input(x0, 0), dual::input(y0, 1), dual::input(z0, 2));
+    cout << format("w = {:.5}, wx = {:.5}, wy = {:.5}, wz = {:.5}\n", w, w.diff(0),
+                   w.diff(1), w.diff(2));
+    assert(abs((w.diff(0) + w.diff(1) + w.diff(2)) - (ux + uy + uz)) < eqeps);
+
     return 0;
 }
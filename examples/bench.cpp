@@ -0,0 +1,325 @@
+#include "fixed_tensor.hpp"
+#include "lanes.hpp"
+#include "optim.hpp"
+#include "parallel.hpp"
+#include "program.hpp"
+#include "tensor.hpp"
+#include "variable.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <vector>
+
+template <typename F> double measure(F&& f, int repeat = 5) {
+    double best = INFINITY;
+    for (int i = 0; i < repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+void report(std::string_view name, double ms) {
+    std::cout << std::format("{:<52}{:>10.3f} ms\n", name, ms);
+}
+
+// a wide, shallow graph shaped like a dense layer: sum_i tanh(w_i * x + b_i)
+var layer(const std::vector<var>& w, const std::vector<var>& b, const var& x) {
+    var sum = 0;
+    for (size_t i = 0; i < w.size(); i++) sum = sum + tanh(w[i] * x + b[i]);
+    return sum;
+}
+
+void bench_backward(size_t n) {
+    std::vector<var> w, b;
+    for (size_t i = 0; i < n; i++) {
+        w.emplace_back(std::sin(i));
+        b.emplace_back(std::cos(i));
+    }
+    var x = 0.5;
+
+    auto backward = [&](bool arena) {
+        std::optional<TapeArena<double>::Scope> scope;
+        if (arena) scope.emplace();
+        var y = layer(w, b, x);
+        return measure([&] { y.propagate(true); });
+    };
+    report(std::format("backward, {} terms, graph traversal", n), backward(false));
+    report(std::format("backward, {} terms, linear sweep", n), backward(true));
+}
+
+// fully connected, sigmoid activations
+class MLP {
+    std::vector<std::vector<std::vector<var>>> layers;  // [layer][output][input]
+
+public:
+    MLP(std::vector<size_t> sizes) {
+        std::mt19937 gen(42);
+        std::uniform_real_distribution<double> dist(-1, 1);
+        for (size_t l = 0; l + 1 < sizes.size(); l++) {
+            layers.emplace_back(sizes[l + 1]);
+            for (auto& row : layers.back()) {
+                for (size_t i = 0; i < sizes[l]; i++) row.emplace_back(dist(gen));
+            }
+        }
+    }
+    std::vector<var*> parameters() {
+        std::vector<var*> params;
+        for (auto& layer : layers)
+            for (auto& row : layer)
+                for (auto& w : row) params.push_back(&w);
+        return params;
+    }
+    var forward(std::vector<var> x) const {
+        for (const auto& layer : layers) {
+            std::vector<var> y;
+            for (const auto& row : layer) {
+                var sum = 0;
+                for (size_t i = 0; i < row.size(); i++) sum = sum + row[i] * x[i];
+                y.push_back(1 / (1 + exp(-sum)));
+            }
+            x = std::move(y);
+        }
+        return x[0];
+    }
+    var loss(const std::vector<var>& x, const var& label) const {
+        var diff = forward(x) - label;
+        return diff * diff;
+    }
+};
+
+void bench_training(std::string_view name, std::vector<size_t> sizes, size_t samples) {
+    MLP model(sizes);
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<double> dist(0, 1);
+    std::vector<std::vector<double>> data(samples, std::vector<double>(sizes[0]));
+    std::vector<double> labels(samples);
+    for (auto& x : data) std::generate(x.begin(), x.end(), [&] { return dist(gen); });
+    std::generate(labels.begin(), labels.end(), [&] { return dist(gen); });
+
+    auto rebuild = [&](bool arena) {
+        return measure([&] {
+            for (size_t s = 0; s < samples; s++) {
+                std::optional<TapeArena<double>::Scope> scope;
+                if (arena) scope.emplace();
+                std::vector<var> x(data[s].begin(), data[s].end());
+                model.loss(x, labels[s]).propagate();
+            }
+        });
+    };
+    std::vector<var> x(sizes[0]);
+    var label = 0;
+    Program<double> program(model.loss(x, label));
+    double replay = measure([&] {
+        for (size_t s = 0; s < samples; s++) {
+            for (size_t i = 0; i < x.size(); i++) x[i].raw() = data[s][i];
+            label.raw() = labels[s];
+            program.forward();
+            program.backward();
+        }
+    });
+    auto data_parallel = [&] {
+        std::vector<AutoDiff<double>*> params;
+        for (auto& p : model.parameters()) params.push_back(p);
+        DataParallel<double> parallel(params);
+        return measure([&] {
+            parallel.backward(samples, [&](size_t s) {
+                std::vector<var> x(data[s].begin(), data[s].end());
+                return model.loss(x, labels[s]);
+            });
+        });
+    };
+    report(std::format("{}, rebuild graph", name), rebuild(false));
+    report(std::format("{}, rebuild graph on arena", name), rebuild(true));
+    report(std::format("{}, replay program", name), replay);
+    report(std::format("{}, {} threads", name, ThreadPool::shared().size()),
+           data_parallel());
+}
+
+// gradient of one expression at many points, one point per graph or one per lane
+void bench_lanes(size_t points) {
+    constexpr size_t N = 8;
+    auto func = [](const auto& x, const auto& y) {
+        auto s = x * y;
+        return tanh(s) * exp(-x * x) + sqrt(y * y + 1) / (1 + x * x);
+    };
+    std::vector<double> xs(points), ys(points);
+    for (size_t i = 0; i < points; i++) xs[i] = std::sin(i), ys[i] = std::cos(i);
+
+    double scalar = measure([&] {
+        TapeArena<double>::Scope scope;
+        for (size_t i = 0; i < points; i++) {
+            var x = xs[i], y = ys[i];
+            func(x, y).propagate();
+        }
+    });
+    double batched = measure([&] {
+        TapeArena<Lanes<double, N>>::Scope scope;
+        for (size_t i = 0; i + N <= points; i += N) {
+            Lanes<double, N> x0, y0;
+            for (size_t j = 0; j < N; j++) x0[j] = xs[i + j], y0[j] = ys[i + j];
+            Variable<Lanes<double, N>> x = x0, y = y0;
+            func(x, y).propagate();
+        }
+    });
+    report(std::format("gradient at {} points, one graph per point", points), scalar);
+    report(std::format("gradient at {} points, {} lanes per graph", points, N), batched);
+}
+
+// element-wise copy and compare of a 1M-element tensor, contiguous and through a view
+void bench_tensor() {
+    auto a = Tensor<double>::ones({100, 100, 100});
+    auto b = Tensor<double>::zeros({100, 100, 100});
+    Tensor<double> view(Storage<double>(a.data(), {1, 100, 10000}, {0, 0, 0}),
+                        {100, 100, 100});
+    report("tensor 100x100x100, assign and compare", measure([&] {
+               b = a;
+               if (!(b == a)) std::abort();
+           }));
+    report("tensor 100x100x100, assign and compare, strided", measure([&] {
+               b = view;
+               if (!(b == view)) std::abort();
+           }));
+    // 100 mini-batches of 10000 elements, as views and as copies
+    double total = 0;
+    report("tensor 100x100x100, 100 slices, views", measure([&] {
+               for (size_t i = 0; i < 100; i++) total += a.slice({i})[0, 0];
+           }));
+    report("tensor 100x100x100, 100 slices, copies", measure([&] {
+               for (size_t i = 0; i < 100; i++) {
+                   auto slice = a.slice({i});
+                   total += Tensor(slice)[0, 0];
+               }
+           }));
+    if (total == 0) std::abort();
+
+    // a bias over the rows of a matrix, broadcast by the engine against an explicit copy
+    auto m = Tensor<double>::ones({1000, 1000}), bias = Tensor<double>::ones({1000});
+    report("tensor 1000x1000 + bias, broadcast",
+           measure([&] { total += (m + bias)[0, 0]; }));
+    report("tensor 1000x1000 + bias, expanded copy", measure([&] {
+               total += (m + Tensor(bias.expand({1000, 1000})))[0, 0];
+           }));
+    report("tensor 1000x1000 += bias, in place", measure([&] { m += bias; }));
+}
+
+// dense layer sized product, blocked kernel against the textbook triple loop
+void bench_matmul(size_t n) {
+    auto a = Tensor<double>::ones({n, n}), b = Tensor<double>::ones({n, n});
+    double flops = 2.0 * n * n * n;
+    double blocked = measure([&] { matmul(a, b); });
+    double naive = measure([&] {
+        auto c = Tensor<double>::zeros({n, n});
+        for (size_t i = 0; i < n; i++)
+            for (size_t p = 0; p < n; p++)
+                for (size_t j = 0; j < n; j++) c[i, j] += a[i, p] * b[p, j];
+    });
+    report(std::format("matmul {0}x{0}, triple loop ({1:.1f} GFLOP/s)", n,
+                       flops / naive / 1e6),
+           naive);
+    report(std::format("matmul {0}x{0}, blocked ({1:.1f} GFLOP/s)", n,
+                       flops / blocked / 1e6),
+           blocked);
+}
+
+// forward and backward of a dense layer, sum(tanh(x * w)), on scalar and tensor nodes
+void bench_dense(size_t batch, size_t in, size_t out) {
+    std::vector<double> x(batch * in), w(in * out);
+    for (size_t i = 0; i < x.size(); i++) x[i] = std::sin(i);
+    for (size_t i = 0; i < w.size(); i++) w[i] = std::cos(i) / in;
+    double scalar = measure([&] {
+        TapeArena<double>::Scope arena;
+        std::vector<var> ws(w.begin(), w.end());
+        var loss = 0;
+        for (size_t i = 0; i < batch; i++) {
+            for (size_t j = 0; j < out; j++) {
+                var dot = 0;
+                for (size_t p = 0; p < in; p++)
+                    dot = dot + x[i * in + p] * ws[p * out + j];
+                loss = loss + tanh(dot);
+            }
+        }
+        loss.propagate();
+    });
+    Tensor<double> tx({batch, in}), tw({in, out});
+    std::copy(x.begin(), x.end(), tx.data()), std::copy(w.begin(), w.end(), tw.data());
+    double tensor = measure([&] {
+        Variable<Tensor<double>> vx = tx, vw = tw;
+        vx.require_diff(false);
+        sum(tanh(matmul(vx, vw))).propagate();
+    });
+    auto name = std::format("dense {}x{} -> {}, forward and backward", batch, in, out);
+    report(name + ", scalar nodes", scalar);
+    report(name + ", tensor nodes", tensor);
+}
+
+// reductions of a 1000x1000 tensor against a serial loop
+void bench_reduce() {
+    Tensor<double> t({1000, 1000});
+    for (size_t i = 0; i < t.size(); i++) t.data()[i] = std::sin(i);
+    double total = 0;
+    report("reduce 1000x1000, serial loop", measure([&] {
+               for (size_t i = 0; i < t.size(); i++) total += t.data()[i];
+           }));
+    report("reduce 1000x1000, sum", measure([&] { total += t.sum(); }));
+    report("reduce 1000x1000, sum along rows", measure([&] { total += t.sum(1)[0]; }));
+    report("reduce 1000x1000, sum along columns", measure([&] { total += t.sum(0)[0]; }));
+    report("reduce 1000x1000, max along columns", measure([&] { total += t.max(0)[0]; }));
+    if (total == 0) std::abort();
+}
+
+// rotating 4-vectors by a 4x4 transform, as in a physics step
+void bench_small_matmul(size_t steps) {
+    Tensor<double, 4, 4> fixed;
+    Tensor<double> dynamic({4, 4});
+    for (size_t i = 0; i < 4; i++)
+        for (size_t j = 0; j < 4; j++) fixed[i, j] = dynamic[i, j] = std::cos(i + j) / 4;
+    double total = 0;
+    report(std::format("4x4 matmul, {} steps, fixed shape", steps), measure([&] {
+               Tensor<double, 4> x(1.0);
+               for (size_t i = 0; i < steps; i++) x = matmul(fixed, x);
+               total += x.sum();
+           }));
+    report(std::format("4x4 matmul, {} steps, dynamic shape", steps), measure([&] {
+               Tensor<double> x = Tensor<double>::ones({4, 1});
+               for (size_t i = 0; i < steps; i++) x = matmul(dynamic, x);
+               total += x.sum();
+           }));
+    if (std::isnan(total)) std::abort();
+}
+
+// one Adam step over `n` scalar parameters
+void bench_optimizer(size_t n) {
+    std::vector<var> params(n);
+    std::vector<AutoDiff<double>*> pointers;
+    for (auto& p : params) pointers.push_back(&p);
+    optim::Adam<double> adam(pointers, 1e-3);
+    adam.run_on(nullptr);
+    report(std::format("adam step, {} parameters", n), measure([&] { adam.step(); }));
+    adam.run_on(&ThreadPool::shared());
+    size_t threads = ThreadPool::shared().size();
+    report(std::format("adam step, {} parameters, {} threads", n, threads),
+           measure([&] { adam.step(); }));
+}
+
+int main() {
+    for (size_t n : {1000, 100000, 1000000}) bench_backward(n);
+    bench_training("xor 2-8-1, 1000 samples", {2, 8, 1}, 1000);
+    bench_training("mlp 16-64-64-1, 100 samples", {16, 64, 64, 1}, 100);
+    bench_lanes(1 << 16);
+    bench_tensor();
+    for (size_t n : {64, 256, 512}) bench_matmul(n);
+    bench_dense(64, 128, 128);
+    bench_reduce();
+    bench_small_matmul(100000);
+    bench_optimizer(1000000);
+    return 0;
+}
@@ -1,4 +1,11 @@
+#include "dual.hpp"
+#include "fixed_tensor.hpp"
+#include "hessian.hpp"
+#include "lanes.hpp"
+#include "npy.hpp"
 #include "optim.hpp"
+#include "parallel.hpp"
+#include "program.hpp"
 #include "tensor.hpp"
 
 #include <random>
@@ -96,6 +103,44 @@ TEST_CASE("sqrt/power") {
     check_func(func, 25, 5, 0);
 }
 
+TEST_CASE("backward from the output") {
+    // exp, tanh, sqrt and power differentiate through the value of their node
+    auto func = [](auto x, auto y) { return exp(x * y) + tanh(x - y) * sqrt(x * x + y); };
+    check_func(func, 0.5, 2);
+    check_func(func, -1.5, 3);
+    check_func(func, 2, 0.25);
+    auto power = [](auto x, auto y) { return pow(x, y) * pow(y, x); };
+    check_func(power, 2, 3);
+    check_func(power, 0.5, 1.5);
+    check_func(power, 3, 0.25);
+    // out / lhs is undefined at a zero base, where the pow-based formula is used
+    for (double p : {1.0, 2.0, 3.0}) {
+        var x = 0, y = p;
+        y.require_diff(false);
+        auto z = pow(x, y);
+        z.propagate();
+        CHECK(x.diff() == (p == 1 ? 1 : 0));
+    }
+}
+
+struct Softplus {
+    static constexpr std::string_view name = "softplus";
+    static double forward(double x) { return std::log1p(std::exp(x)); }
+    static double backward(double diff, double x) { return diff / (1 + std::exp(-x)); }
+};
+
+TEST_CASE("custom operation") {
+    auto softplus = [](auto x) {
+        if constexpr (std::is_same_v<decltype(x), var>)
+            return var(Softplus{}, x);
+        else
+            return Softplus::forward(x);
+    };
+    auto func = [&](auto x, auto y) { return softplus(x * y) + x; };
+    check_func(func, 0.5, -2);
+    check_func(func, 3, 1.5);
+}
+
 TEST_CASE("compare") {
     var nan_number = std::nan("");
     var a = 1, b = 1, c = 2;
@@ -154,8 +199,853 @@ TEST_CASE("fitting") {
     CHECK(std::abs((b - b0).raw()) < 1.0);
 }
 
+TEST_CASE("arena") {
+    var x = 2, y = 3;
+    {
+        TapeArena<double>::Scope scope;
+        var a = x * y, b = a + x;
+        CHECK(b.node == a.node + 1);
+        var u = sin(b) * a;
+        auto [ux, uy] = u.derivative(x, y);
+        auto [ex, ey] = get_diff([](auto x, auto y) { return sin(x * y + x) * (x * y); },
+                                 2.0, 3.0);
+        CHECK(almost_equal(ux + uy, ex));
+        CHECK(almost_equal(ex, ey));
+    }
+    auto first = [&] {
+        TapeArena<double>::Scope scope;
+        var c = x + y;
+        return c.node;
+    };
+    CHECK(first() == first());  // the chunk is rewound once its nodes are gone
+    var z = x + y;
+    CHECK(almost_equal(z.raw(), 5));
+}
+
+TEST_CASE("linear tape") {
+    auto func = [](auto x, auto y) {
+        auto s = x * y;
+        return s * s + exp(s) / (x + 1) - sin(x * x);
+    };
+    var x = 0.7, y = -1.3;
+    var u = func(x, y);
+    auto [ux, uy] = u.derivative(x, y);
+    clear(x, y);
+    TapeArena<double>::Scope scope;
+    var v = func(x, y);
+    var w = x * 10 + y;  // recorded later, unrelated to v
+    CHECK(v.node->linear());
+    v.propagate(true);
+    CHECK(almost_equal(x.diff(), ux));
+    CHECK(almost_equal(y.diff(), uy));
+    clear(x, y);
+    w.propagate();  // must not replay the adjoints left on v's graph
+    CHECK(almost_equal(x.diff(), 10));
+    CHECK(almost_equal(y.diff(), 1));
+    clear(x, y);
+
+    // the slots freed between the nodes of a graph are skipped
+    var s = x * y;
+    {
+        var freed = exp(s) * s + sin(x);
+    }
+    var t = s * s + x;
+    CHECK(t.node->linear());
+    t.propagate();
+    CHECK(almost_equal(x.diff(), 2 * x.raw() * y.raw() * y.raw() + 1));
+    CHECK(almost_equal(y.diff(), 2 * x.raw() * x.raw() * y.raw()));
+}
+
+TEST_CASE("no grad") {
+    var x = 2, c = 3;
+    var y = 0;
+    {
+        autodiff::no_grad guard;
+        y = x * x + 1;
+        CHECK(y.node == nullptr);
+        CHECK(almost_equal(y.raw(), 5));
+    }
+    c.require_diff(false);
+    auto check = [&] {
+        var u = y * x + sin(c) * x + c;
+        u.propagate();
+        CHECK(almost_equal(x.diff(), 5 + std::sin(3)));
+        CHECK(c.diff() == 0);
+        CHECK(y.diff() == 0);
+        clear(x, y, c);
+    };
+    check();
+    TapeArena<double>::Scope scope;
+    check();
+}
+
+TEST_CASE("program") {
+    auto func = [](auto x, auto y, auto c) {
+        auto s = x * y;
+        return pow(s, c) + tanh(s) * sqrt(x) - sin(y) / exp(x) + log(s * s);
+    };
+    var x = 1.5, y = -0.5, c = 2;
+    c.require_diff(false);
+    Program<double> program(func(x, y, c));
+    for (auto [x0, y0] : {std::pair{1.5, -0.5}, {0.3, 2.0}, {4.0, 1.0}}) {
+        x.raw() = x0, y.raw() = y0;
+        program.forward();
+        CHECK(almost_equal(program.value(), func(x0, y0, 2.0)));
+        program.backward();
+        CHECK(almost_equal(x.diff(), num_diff([&](auto x) { return func(x, y0, 2.0); },
+                                              eps, x0)));
+        CHECK(almost_equal(y.diff(), num_diff([&](auto y) { return func(x0, y, 2.0); },
+                                              eps, y0)));
+        CHECK(c.diff() == 0);
+        clear(x, y);
+    }
+}
+
+TEST_CASE("deep graph") {
+    var x = 1;
+    SUBCASE("arena") {
+        const int depth = 10'000'000;
+        TapeArena<double>::Scope scope;
+        var y = x;
+        for (int i = 0; i < depth; i++) y = y + x;
+        y.propagate();
+        CHECK(x.diff() == depth + 1);
+    }
+    SUBCASE("heap") {
+        const int depth = 10'000'000;
+        var y = x;
+        for (int i = 0; i < depth; i++) y = y + x;
+        y.propagate();
+        CHECK(x.diff() == depth + 1);
+    }
+    SUBCASE("print") {
+        const int depth = 100'000;
+        var y = x;
+        for (int i = 0; i < depth; i++) y = y * 1 + x;
+        y.propagate(true);
+        CHECK(x.diff() == depth + 1);
+        std::ostringstream sink;
+        auto buf = std::cerr.rdbuf(sink.rdbuf());
+        y.node->print();
+        std::cerr.rdbuf(buf);
+        CHECK(std::count(sink.view().begin(), sink.view().end(), '\n') > 4 * depth);
+    }
+}
+
+TEST_CASE("data parallel") {
+    // least squares fit of y = a * x^2 + b * x + c
+    std::vector<double> xs, ys;
+    for (int i = 0; i < 103; i++) {
+        xs.push_back(std::sin(i)), ys.push_back(std::cos(i));
+    }
+    var a = 0.5, b = -1.0, c = 0.25;
+    auto loss = [&](size_t s) {
+        var x = xs[s];
+        var r = (a * x + b) * x + c - ys[s];
+        return r * r;
+    };
+    double total = 0;
+    for (size_t s = 0; s < xs.size(); s++) {
+        auto l = loss(s);
+        l.propagate();
+        total += l.raw();
+    }
+    double da = a.diff(), db = b.diff(), dc = c.diff();
+    clear(a, b, c);
+
+    ThreadPool pool(4);
+    DataParallel<double> parallel({&a, &b, &c}, 8, pool);
+    CHECK(almost_equal(parallel.backward(xs.size(), loss), total));
+    CHECK(almost_equal(a.diff(), da));
+    CHECK(almost_equal(b.diff(), db));
+    CHECK(almost_equal(c.diff(), dc));
+    // reduced in shard order: bit-identical from run to run
+    double first[] = {a.diff(), b.diff(), c.diff()};
+    for (int run = 0; run < 5; run++) {
+        clear(a, b, c);
+        parallel.backward(xs.size(), loss);
+        CHECK(a.diff() == first[0]);
+        CHECK(b.diff() == first[1]);
+        CHECK(c.diff() == first[2]);
+    }
+    // the default number of shards does not depend on the number of threads
+    for (size_t threads : {1, 3, 8}) {
+        ThreadPool other(threads);
+        DataParallel<double> fixed({&a, &b, &c}, other);
+        clear(a, b, c);
+        fixed.backward(xs.size(), loss);
+        if (threads == 1) first[0] = a.diff(), first[1] = b.diff(), first[2] = c.diff();
+        CHECK(a.diff() == first[0]);
+        CHECK(b.diff() == first[1]);
+        CHECK(c.diff() == first[2]);
+    }
+    // parameters are still usable on their own
+    clear(a, b, c);
+    loss(1).propagate();
+    CHECK(a.diff() != 0);
+
+    CHECK_THROWS(pool.run(3, [](size_t i) {
+        if (i == 1) throw std::runtime_error("task failed");
+    }));
+}
+
+TEST_CASE("dual") {
+    auto func = [](auto x, auto y, auto c) {
+        using std::abs;
+        auto s = x * y;
+        return pow(s, c) + tanh(s) * sqrt(x) - sin(y) / exp(x) + log(s * s) +
+               atan(abs(x - y)) * cosh(y) / (1 + x * x);
+    };
+    using dual = Dual<double, 2>;
+    for (auto [x0, y0] : {std::pair{1.5, -0.5}, {0.3, 2.0}, {4.0, 1.0}}) {
+        auto u = func(dual::input(x0, 0), dual::input(y0, 1), dual(2));
+        CHECK(almost_equal(u.raw(), func(x0, y0, 2.0)));
+        var x = x0, y = y0, c = 2;
+        func(x, y, c).propagate();
+        CHECK(almost_equal(u.diff(0), x.diff()));
+        CHECK(almost_equal(u.diff(1), y.diff()));
+
+        // Jacobian-vector product along (1, -2) with a single tangent
+        auto v = func(Dual<double>(x0, {1}), Dual<double>(y0, {-2}), Dual<double>(2));
+        CHECK(almost_equal(v.diff(), x.diff() - 2 * y.diff()));
+    }
+}
+
+TEST_CASE("lanes") {
+    using lanes = Lanes<double, 4>;
+    auto func = [](auto x, auto y) {
+        auto s = x * y;
+        return pow(x, y) + tanh(s) * abs(x) - sin(y) / exp(x) + log(y * y);
+    };
+    // mixed signs and a zero base, so that every branch of a formula is taken per lane
+    lanes xs{1.5, -0.5, 0.0, 2.0}, ys{2.0, 3.0, 2.0, -1.5};
+    Variable<lanes> x = xs, y = ys;
+    auto u = func(x, y);
+    u.propagate();
+    for (size_t i = 0; i < lanes::size(); i++) {
+        var xi = xs[i], yi = ys[i];
+        auto ui = func(xi, yi);
+        CHECK(almost_equal(u.raw()[i], ui.raw()));
+        ui.propagate();
+        CHECK(almost_equal(x.diff()[i], xi.diff()));
+        CHECK(almost_equal(y.diff()[i], yi.diff()));
+    }
+
+    // a parameter shared by the batch gets one gradient per lane
+    Variable<lanes> w = lanes(0.5);
+    auto loss = (w * x - y) * (w * x - y);
+    loss.propagate();
+    double total = 0;
+    for (size_t i = 0; i < lanes::size(); i++) {
+        double expected = 2 * (0.5 * xs[i] - ys[i]) * xs[i];
+        CHECK(almost_equal(w.diff()[i], expected));
+        total += expected;
+    }
+    CHECK(almost_equal(w.diff().sum(), total));
+}
+
+TEST_CASE("matmul") {
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    auto random = [&](std::initializer_list<size_t> shape) {
+        Tensor<double> t(shape);
+        std::generate(t.data(), t.data() + t.size(), [&] { return dist(gen); });
+        return t;
+    };
+    auto naive = [](size_t m, size_t n, size_t k, auto a, auto b) {
+        std::vector<double> c(m * n);
+        for (size_t i = 0; i < m; i++)
+            for (size_t j = 0; j < n; j++)
+                for (size_t p = 0; p < k; p++) c[i * n + j] += a(i, p) * b(p, j);
+        return c;
+    };
+    auto same = [](const Tensor<double>& t, const std::vector<double>& expected,
+                   size_t offset = 0) {
+        for (size_t i = 0; i < expected.size(); i++)
+            if (std::fabs(t.data()[offset + i] - expected[i]) > 1e-9) return false;
+        return true;
+    };
+
+    // borders of every blocking level: partial tiles, k > kc, m > mc
+    for (auto [m, n, k] : {std::tuple<size_t, size_t, size_t>{1, 1, 1},
+                           {7, 13, 5},
+                           {6, 8, 300},
+                           {100, 37, 513}}) {
+        auto a = random({m, k}), b = random({k, n});
+        auto c = matmul(a, b);
+        CHECK(c.shape() == Shape{m, n});
+        CHECK(same(c, naive(m, n, k, [&](size_t i, size_t p) { return a[i, p]; },
+                            [&](size_t p, size_t j) { return b[p, j]; })));
+    }
+
+    // transposed view as the right operand
+    auto a = random({5, 9}), b = random({4, 9});
+    Tensor<double> bt(Storage<double>(b.data(), {1, 9}, {0, 0}), {9, 4});
+    CHECK(same(matmul(a, bt), naive(5, 4, 9, [&](size_t i, size_t p) { return a[i, p]; },
+                                    [&](size_t p, size_t j) { return b[j, p]; })));
+
+    // batched, with a batch of right operands and with a shared one
+    auto x = random({3, 4, 6}), y = random({3, 6, 2}), w = random({6, 2});
+    auto xy = matmul(x, y), xw = matmul(x, w);
+    CHECK(xy.shape() == Shape{3, 4, 2});
+    for (size_t s = 0; s < 3; s++) {
+        auto lhs = [&](size_t i, size_t p) { return x[s, i, p]; };
+        auto rhs = [&](size_t p, size_t j) { return y[s, p, j]; };
+        auto shared = [&](size_t p, size_t j) { return w[p, j]; };
+        CHECK(same(xy, naive(4, 2, 6, lhs, rhs), s * 8));
+        CHECK(same(xw, naive(4, 2, 6, lhs, shared), s * 8));
+    }
+}
+
 TEST_CASE("tensor") {
-    // auto t = Tensor<double>::ones({2, 3, 4});
-    // t[0, {0, 2}, {1, 3}] = Tensor<double>::zeros({2, 2});
-    // CHECK(t[0, 0, 1] == 0);
+    auto t = Tensor<double>::ones({2, 3, 4});
+    CHECK(t.size() == 24);
+    CHECK(t.is_contiguous());
+    t[1, 2, 3] = 5;
+    CHECK(t.data()[23] == 5);
+    CHECK(t.storage()[Shape{1, 2, 3}] == 5);
+    auto u = Tensor<double>::zeros({2, 3, 4});
+    CHECK(!(u == t));
+    u = t;
+    CHECK(u == t);
+    CHECK(u[1, 2, 3] == 5);
+
+    // a transposed view of `t` is not contiguous and goes through indices
+    Tensor<double> v(Storage<double>(t.data(), {1, 4, 12}, {0, 0, 0}), {4, 3, 2});
+    CHECK(!v.is_contiguous());
+    CHECK(v[3, 2, 1] == 5);
+    auto w = Tensor<double>::zeros({4, 3, 2});
+    w = v;
+    CHECK(w == v);
+    CHECK(w.data()[23] == 5);
+
+    // writing through a slice
+    t.slice({0, {0, 2}, {1, 3}}) = Tensor<double>::zeros({2, 2});
+    CHECK(t[0, 0, 1] == 0);
+    CHECK(t[0, 1, 2] == 0);
+    CHECK(t[0, 0, 3] == 1);
+    CHECK(t[0, 2, 1] == 1);
+}
+
+TEST_CASE("tensor views") {
+    Tensor<double> t({2, 3, 4});
+    std::iota(t.data(), t.data() + t.size(), 0);
+
+    // views share the elements of `t`
+    auto batch = t.slice({{1, 2}});
+    CHECK(batch.shape() == Shape{1, 3, 4});
+    CHECK(batch.is_contiguous());
+    CHECK(batch.data() == t.data() + 12);
+    auto strided = t.slice({1, {0, 3, 2}, {1, 4, 2}});
+    CHECK(strided.shape() == Shape{2, 2});
+    CHECK(strided[1, 1] == t[1, 2, 3]);
+    strided[0, 0] = -1;
+    CHECK(t[1, 0, 1] == -1);
+
+    auto p = t.permute({2, 0, 1});
+    CHECK(p.shape() == Shape{4, 2, 3});
+    CHECK(p[3, 1, 2] == t[1, 2, 3]);
+    CHECK(p.data() == t.data());
+    CHECK(t.transpose()[1, 3, 2] == t[1, 2, 3]);
+    CHECK(t.transpose(0, 2).shape() == Shape{4, 3, 2});
+
+    auto flat = t.view({24});
+    CHECK(flat.data() == t.data());
+    CHECK(flat[23] == t[1, 2, 3]);
+    CHECK(t.reshape({6, 4}).data() == t.data());
+    // a permuted tensor is not contiguous: `reshape` copies, `contiguous` too
+    auto copy = p.reshape({24});
+    CHECK(copy.data() != t.data());
+    CHECK(copy[23] == t[1, 2, 3]);
+    CHECK(p.contiguous() == copy.view({4, 2, 3}));
+    CHECK(t.contiguous().data() == t.data());
+
+    auto u = t.slice({0, 1}).unsqueeze(0);
+    CHECK(u.shape() == Shape{1, 4});
+    CHECK(u.is_contiguous());
+    CHECK(u.squeeze().shape() == Shape{4});
+    CHECK(u.squeeze(0)[2] == t[0, 1, 2]);
+
+    // broadcast with stride 0
+    auto e = u.expand({3, 2, 4});
+    CHECK(e.shape() == Shape{3, 2, 4});
+    CHECK(e[2, 1, 3] == t[0, 1, 3]);
+    CHECK(e.storage().strides == Shape{0, 0, 1});
+    CHECK((e + Tensor<double>::ones({3, 2, 4}))[1, 0, 2] == t[0, 1, 2] + 1);
+}
+
+TEST_CASE("tensor autodiff") {
+    using tensor = Variable<Tensor<double>>;
+    std::mt19937 gen(2);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    auto random = [&](std::initializer_list<size_t> shape) {
+        Tensor<double> t(shape);
+        std::generate(t.data(), t.data() + t.size(), [&] { return dist(gen); });
+        return t;
+    };
+    auto x = random({4, 3}), w = random({3, 2}), c = random({4, 2});
+
+    // one node per tensor operation, with a broadcast bias
+    tensor tw = w, tb = 0.1, tx = x, tc = c;
+    tx.require_diff(false), tc.require_diff(false);
+    auto loss = sum(tanh(matmul(tx, tw) + tb) * tc);
+    CHECK(Program(loss).size() == 5);
+    loss.propagate();
+
+    // the same function on scalar variables
+    std::vector<var> sw(w.data(), w.data() + w.size());
+    var sb = 0.1, sloss = 0;
+    for (size_t i = 0; i < 4; i++) {
+        for (size_t j = 0; j < 2; j++) {
+            var dot = 0;
+            for (size_t p = 0; p < 3; p++) dot = dot + x[i, p] * sw[p * 2 + j];
+            sloss = sloss + tanh(dot + sb) * c[i, j];
+        }
+    }
+    CHECK(almost_equal(loss.raw().item(), sloss.raw()));
+    sloss.propagate();
+    CHECK(tw.diff().shape() == w.shape());
+    for (size_t i = 0; i < w.size(); i++)
+        CHECK(almost_equal(tw.diff().data()[i], sw[i].diff()));
+    CHECK(tb.diff().shape() == Shape{1});
+    CHECK(almost_equal(tb.diff().item(), sb.diff()));
+
+    // mean, transpose and reshape
+    tensor v = w;
+    auto flat = reshape(transpose(v), {6});
+    CHECK(flat.raw().shape() == Shape{6});
+    CHECK(flat.raw()[1] == w[1, 0]);
+    mean(flat * flat).propagate();
+    for (size_t i = 0; i < w.size(); i++)
+        CHECK(almost_equal(v.diff().data()[i], 2 * w.data()[i] / 6));
+    // the target shape travels with the op, and outlives the graph in a recorded program
+    Program<Tensor<double>> program(reshape(transpose(v), {3, 2}));
+    CHECK(program.size() == 2);
+    CHECK(program.forward() == Tensor<double>({3, 2}, {w[0, 0], w[1, 0], w[2, 0],
+                                                       w[0, 1], w[1, 1], w[2, 1]}));
+
+    // a weight shared by a batch gets the gradient summed over it
+    auto xs = random({2, 4, 3});
+    tensor batched = w, flat_w = w;
+    sum(matmul(tensor(xs), batched)).propagate();
+    sum(matmul(tensor(xs.reshape({8, 3})), flat_w)).propagate();
+    CHECK(batched.diff().shape() == w.shape());
+    for (size_t i = 0; i < w.size(); i++)
+        CHECK(almost_equal(batched.diff().data()[i], flat_w.diff().data()[i]));
+}
+
+TEST_CASE("tensor copy-on-write") {
+    auto a = Tensor<double>::ones({2, 3});
+    auto shares = [](const Tensor<double>& x, const Tensor<double>& y) {
+        return x.storage().data() == y.storage().data();
+    };
+
+    // copies share the buffer until one of them is written
+    auto b = a;
+    CHECK(shares(a, b));
+    CHECK(b.sum() == 6);
+    CHECK(shares(a, b));
+    b[0, 0] = 5;
+    CHECK(!shares(a, b));
+    CHECK(a[0, 0] == 1);
+    CHECK(b[0, 0] == 5);
+
+    // writing through a view of a shared tensor leaves the other owners alone
+    auto c = a;
+    c.slice({0}) = Tensor<double>::zeros({3});
+    CHECK(c[0, 2] == 0);
+    CHECK(a[0, 2] == 1);
+
+    // views of a shared tensor look into the shared elements until written through
+    auto f = Tensor<double>::ones({2, 3});
+    auto g = f;
+    auto top = g.slice({0});
+    CHECK(shares(f, top));
+    top[2] = 4;
+    CHECK(!shares(f, g));
+    CHECK(shares(g, top));
+    CHECK(g[0, 2] == 4);
+    CHECK(f[0, 2] == 1);
+
+    // a view writes through to its tensor, so copying a viewed tensor copies its elements
+    auto row = a.slice({1});
+    auto d = a;
+    CHECK(!shares(a, d));
+    row[1] = 7;
+    CHECK(a[1, 1] == 7);
+    CHECK(d[1, 1] == 1);
+
+    // views keep the buffer alive
+    Tensor<double> view;
+    {
+        auto t = Tensor<double>::ones({2, 2});
+        view = t.slice({1});
+    }
+    CHECK(view.shape() == Shape{2});
+    CHECK(view[1] == 1);
+
+    // a moved-from tensor is empty, and takes a copy of what is assigned to it
+    auto moved = Tensor<double>::ones({2, 3});
+    auto taken = std::move(moved);
+    CHECK(moved.empty());
+    CHECK(moved.size() == 0);
+    moved = taken.slice({{0, 2}});
+    CHECK(moved.shape() == Shape{2, 3});
+    CHECK(moved.sum() == 6);
+    CHECK(!shares(moved, taken));
+}
+
+TEST_CASE("broadcasting") {
+    Tensor<double> m({2, 3}), row({3}), col({2, 1});
+    for (size_t i = 0; i < 6; i++) m.data()[i] = i;
+    for (size_t j = 0; j < 3; j++) row.data()[j] = 10 * (j + 1);
+    col.data()[0] = 1, col.data()[1] = 2;
+
+    // shapes are aligned on their last dimension and size-1 dimensions are repeated
+    CHECK(Tensor<double>::broadcast({2, 1}, {3}) == Shape{2, 3});
+    auto biased = m + row;
+    CHECK(biased.shape() == Shape{2, 3});
+    CHECK(biased[1, 2] == 5 + 30);
+    auto outer = col * row;
+    CHECK(outer.shape() == Shape{2, 3});
+    CHECK(outer[1, 0] == 20);
+    CHECK((row - m)[0, 1] == 19);
+
+    // in place when the result keeps the shape, otherwise the tensor grows
+    auto acc = m;
+    acc += row;
+    CHECK(acc == biased);
+    auto grown = row;
+    grown += col;
+    CHECK(grown.shape() == Shape{2, 3});
+    CHECK(grown[1, 1] == 22);
+    CHECK(m.sum_to({3})[2] == 2 + 5);
+    CHECK(m.sum_to({2, 1})[1, 0] == 3 + 4 + 5);
+
+    // strided operands: a transposed view and a column slice
+    auto t = m.transpose();
+    auto twice = t + t;
+    CHECK(twice.shape() == Shape{3, 2});
+    CHECK(twice[2, 1] == 10);
+    auto last = m.slice({{0, 2}, 2});
+    CHECK((last * 2)[1] == 10);
+
+    // the gradient of a broadcast operand is summed over the dimensions it repeats along
+    using tensor = Variable<Tensor<double>>;
+    tensor x = m, bias = row;
+    x.require_diff(false);
+    sum(x * bias).propagate();
+    CHECK(bias.diff().shape() == Shape{3});
+    CHECK(bias.diff()[1] == 1 + 4);
+}
+
+TEST_CASE("buffer pool") {
+    auto& pool = BufferPool::shared();
+    for (size_t n : {1, 3, 100, 1000}) {
+        auto t = Tensor<double>::ones({n});
+        CHECK(reinterpret_cast<uintptr_t>(t.data()) % BufferPool::alignment == 0);
+    }
+    Tensor<bool> mask({7});
+    CHECK(reinterpret_cast<uintptr_t>(mask.data()) % BufferPool::alignment == 0);
+
+    // a training step allocates the same temporaries every time: once the first steps
+    // have filled the cache (the first one also creates the gradients), the following
+    // ones are served from it
+    using tensor = Variable<Tensor<double>>;
+    tensor x = Tensor<double>::ones({16, 8}), w = Tensor<double>::ones({8, 4});
+    tensor b = Tensor<double>::zeros({4});
+    x.require_diff(false);
+    auto step = [&] { sum(tanh(matmul(x, w) + b)).propagate(); };
+    step(), step();
+    auto before = pool.stats();
+    for (int i = 0; i < 3; i++) step();
+    auto after = pool.stats();
+    CHECK(after.misses == before.misses);
+    CHECK(after.hits > before.hits);
+    CHECK(after.in_use == before.in_use);
+    CHECK(after.peak == before.peak);
+}
+
+TEST_CASE("reductions") {
+    Tensor<double> m({2, 3}, {1, 5, 2, 4, 3, 6});
+    CHECK(m.sum() == 21);
+    CHECK(m.sum(0) == Tensor<double>({3}, {5, 8, 8}));
+    CHECK(m.sum(1, true) == Tensor<double>({2, 1}, {8, 13}));
+    CHECK(m.mean(1) == Tensor<double>({2}, {8.0 / 3, 13.0 / 3}));
+    CHECK(m.max() == 6);
+    CHECK(m.max(0) == Tensor<double>({3}, {4, 5, 6}));
+    CHECK(m.argmax() == 5);
+    CHECK(m.argmax(1) == Tensor<size_t>({2}, {1, 2}));
+    CHECK(almost_equal(m.norm(), std::sqrt(91.0)));
+    CHECK(m.transpose().sum(1) == m.sum(0));
+    CHECK(Tensor<double>({3}, {2, 7, 7}).argmax() == 1);  // the first one
+
+    // large enough to be split into tasks, and to exercise the side by side lanes; the
+    // tree of partial sums only depends on the sizes, so any pool gives the same bits
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    Tensor<double> big({300, 1000});
+    std::generate(big.data(), big.data() + big.size(), [&] { return dist(gen); });
+    auto rows = big.sum(1), cols = big.sum(0);
+    double pairwise = big.sum();
+    double naive = 0;
+    for (size_t i = 0; i < big.size(); i++) naive += big.data()[i];
+    CHECK(almost_equal(pairwise, naive));
+    for (size_t j : {0, 7, 999}) {
+        double col = 0;
+        for (size_t i = 0; i < 300; i++) col += big[i, j];
+        CHECK(almost_equal(cols[j], col));
+    }
+    CHECK(almost_equal(rows.sum(), pairwise));
+    CHECK(big.sum(0) == cols);
+    CHECK(big.argmax(0)[7] == big.slice({{0, 300}, 7}).argmax());
+
+    // gradients
+    using tensor = Variable<Tensor<double>>;
+    tensor x = m;
+    (sum(max(x, 1)) + sum(norm(x, 0)) + sum(mean(x, 0, true))).propagate();
+    auto d = x.diff();
+    // max of row 0 is m[0, 1], norm of column 0 is sqrt(17), mean over 2 rows
+    CHECK(almost_equal(d[0, 0], 1 / std::sqrt(17.0) + 0.5));
+    CHECK(almost_equal(d[0, 1], 1 + 5 / std::sqrt(34.0) + 0.5));
+    CHECK(almost_equal(d[1, 2], 1 + 6 / std::sqrt(40.0) + 0.5));
+    CHECK(almost_equal(d[1, 1], 3 / std::sqrt(34.0) + 0.5));
+}
+
+TEST_CASE("fixed-shape tensor") {
+    using Mat3 = Tensor<double, 3, 3>;
+    using Vec3 = Tensor<double, 3>;
+    static_assert(Mat3::strides == std::array<size_t, 2>{3, 1});
+    static_assert(Mat3::offset(2, 1) == 7);
+    static_assert(sizeof(Mat3) == 9 * sizeof(double));
+
+    // rotation by 90 degrees around z
+    Mat3 rot{0, -1, 0, 1, 0, 0, 0, 0, 1};
+    Vec3 x{1, 2, 3};
+    CHECK(matmul(rot, x) == Vec3{-2, 1, 3});
+    CHECK(matmul(rot, rot.transpose()) == matmul(rot.transpose(), rot));
+    CHECK(matmul(rot, rot)[0, 0] == -1);
+    Tensor<double, 2, 3> a{1, 2, 3, 4, 5, 6};
+    auto ata = matmul(a.transpose(), a);
+    static_assert(std::is_same_v<decltype(ata), Mat3>);
+    CHECK(ata[2, 2] == 45);
+
+    // element-wise, with scalars filling a whole tensor
+    auto y = x * 2.0 + 1.0;
+    CHECK(y == Vec3{3, 5, 7});
+    CHECK((x < 2.5) == Tensor<bool, 3>{true, true, false});
+    CHECK(almost_equal(sqrt(x * x).sum(), 6));
+    y += x;
+    CHECK(y[2] == 10);
+
+    // the same products as dynamic tensors
+    auto product = matmul(a.dynamic(), a.dynamic().transpose());
+    CHECK(Tensor<double, 2, 2>(product) == matmul(a, a.transpose()));
+}
+
+TEST_CASE("npy") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto path = dir / "autodiff_test.npy";
+    Tensor<double> t({2, 3}, {1, 2, 3, 4, 5, 6});
+    npy::save(path, t.transpose());
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::string header(128, '\0');
+        file.read(header.data(), header.size());
+        CHECK(header.find("'descr': '<f8', 'fortran_order': False, 'shape': (3, 2), }") !=
+              std::string::npos);
+        CHECK(std::filesystem::file_size(path) == 128 + 6 * sizeof(double));
+    }
+
+    Tensor<double> row;
+    {
+        Tensor<double> loaded = npy::load<double>(path);
+        CHECK(!loaded.storage().owning());  // a view of the mapped file
+        CHECK(loaded == t.transpose());
+        row = loaded.slice({1});
+    }
+    CHECK(row == Tensor<double>({2}, {2, 5}));  // the view keeps the mapping alive
+    // the mapping is read-only: the first write copies the elements
+    const double* mapped = std::as_const(row).data();
+    row[0] = 7;
+    CHECK(std::as_const(row).data() != mapped);
+    CHECK(row == Tensor<double>({2}, {7, 5}));
+    const auto reloaded = npy::load<double>(path);
+    CHECK(reloaded[1, 0] == 2);
+
+    // written by numpy: np.save(path, np.asfortranarray([[1, 2, 3], [4, 5, 6]], 'i4'))
+    std::string header = "{'descr': '<i4', 'fortran_order': True, 'shape': (2, 3), }";
+    header.resize(128 - 10 - 1, ' '), header += '\n';
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write("\x93NUMPY\x01\x00\x76\x00", 10) << header;
+        for (int32_t x : {1, 4, 2, 5, 3, 6}) file.write(reinterpret_cast<char*>(&x), 4);
+    }
+    auto fortran = npy::load<int32_t>(path);
+    CHECK(fortran == Tensor<int32_t>({2, 3}, {1, 2, 3, 4, 5, 6}));
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("optimizer step") {
+    var x = 1, y = -2;
+    optim::GradientDescent<double> sgd({&x, &y, &x}, 0.5);
+    CHECK(sgd.size() == 2);
+    (x * x + 3 * y).propagate();
+    sgd.step();
+    CHECK(x.raw() == 0);
+    CHECK(y.raw() == -3.5);
+    CHECK(x.diff() == 0);
+
+    // the first step of Adam moves each parameter by the learning rate against its
+    // gradient, whatever its magnitude
+    std::vector<var> params{1, 2, 3, 4, 5, 6, 7, 8, 9};
+    std::vector<AutoDiff<double>*> pointers;
+    for (auto& p : params) pointers.push_back(&p);
+    optim::Adam<double> adam(pointers, 0.1);
+    var loss = 0;
+    for (size_t i = 0; i < params.size(); i++)
+        loss = loss + params[i] * (i % 2 ? 1e3 : -1e-2);
+    loss.propagate();
+    adam.step();
+    for (size_t i = 0; i < params.size(); i++)
+        CHECK(almost_equal(params[i].raw(), i + 1 + (i % 2 ? -0.1 : 0.1)));
+}
+
+TEST_CASE("parallel optimizer step") {
+    // a few chunks and a partial one, updated serially and on four threads
+    size_t n = 3 * optim::Optimizer<double>::chunk + 5;
+    std::vector<var> serial, threaded;
+    for (size_t i = 0; i < n; i++) {
+        serial.emplace_back(std::sin(i));
+        threaded.emplace_back(std::sin(i));
+    }
+    auto pointers = [](std::vector<var>& params) {
+        std::vector<AutoDiff<double>*> pointers;
+        for (auto& p : params) pointers.push_back(&p);
+        return pointers;
+    };
+    ThreadPool pool(4);
+    optim::Adam<double> adam_serial(pointers(serial), 1e-2);
+    optim::Adam<double> adam_threaded(pointers(threaded), 1e-2);
+    adam_serial.run_on(nullptr), adam_threaded.run_on(&pool);
+    for (int iter = 0; iter < 3; iter++) {
+        for (auto params : {&serial, &threaded}) {
+            for (size_t i = 0; i < n; i++) {
+                TapeArena<double>::Scope arena;
+                auto loss = (*params)[i] * (*params)[i] * std::cos(i);
+                loss.propagate();
+            }
+        }
+        adam_serial.step(), adam_threaded.step();
+    }
+    size_t mismatches = 0;
+    for (size_t i = 0; i < n; i++) mismatches += serial[i].raw() != threaded[i].raw();
+    CHECK(mismatches == 0);
+
+    // the vector kernel and the scalar tail round alike, whatever the offset of a chunk
+    optim::kernel::Adam<double> kernel{0.9, 0.999, 1e-2, 1.5, 1e-8};
+    std::vector<double> x(11), g(11), m(11), v(11);
+    for (size_t i = 0; i < x.size(); i++)
+        x[i] = std::sin(i), g[i] = std::cos(3 * i), m[i] = 0.1 * g[i], v[i] = g[i] * g[i];
+    auto xs = x, ms = m, vs = v;
+    kernel.run(x.size(), x.data(), g.data(), m.data(), v.data());
+    for (size_t i = 0; i < x.size(); i++) kernel.element(xs[i], g[i], ms[i], vs[i]);
+    CHECK(x == xs);
+    CHECK(m == ms);
+    CHECK(v == vs);
+}
+
+TEST_CASE("parameter registry") {
+    var x = 2, y = 3;
+    {
+        optim::Parameters<double> params({&x, &y});
+        (x * y + x).propagate();
+        CHECK(params.grads()[0] == 4);
+        CHECK(params.grads()[1] == 2);
+        CHECK(x.diff() == 4);
+        (x * x).propagate();  // gradients accumulate in the buffer
+        CHECK(params.grads()[0] == 8);
+        params.zero_grad();
+        CHECK(x.diff() == 0);
+        CHECK(y.diff() == 0);
+        (y * y).propagate();
+    }
+    CHECK(y.diff() == 6);  // back in the node
+    clear(x, y);
+    CHECK(y.diff() == 0);
+}
+
+TEST_CASE("lbfgs") {
+    // Rosenbrock function, minimum 0 at (1, 1)
+    var x = -1.2, y = 1;
+    int evals = 0;
+    auto rosenbrock = [&] {
+        evals++;
+        return (1 - x) * (1 - x) + 100 * (y - x * x) * (y - x * x);
+    };
+    optim::LBFGS<double> lbfgs({&x, &y}, 5);
+    double loss = 1;
+    int iterations = 0;
+    while (iterations < 100 && loss > 1e-12) loss = lbfgs.step(rosenbrock), iterations++;
+    CHECK(iterations < 50);
+    // the point a step ends on is where the next one starts: no evaluation beyond the
+    // line searches, most of which accept their first trial
+    CHECK(evals < 3 * iterations / 2 + 10);
+    CHECK(std::abs(x.raw() - 1) < 1e-5);
+    CHECK(std::abs(y.raw() - 1) < 1e-5);
+    CHECK(x.diff() == 0);
+
+    // a quadratic with condition number 20: tens of iterations where gradient descent
+    // needs hundreds
+    std::vector<var> params(20);
+    std::vector<AutoDiff<double>*> pointers;
+    for (auto& p : params) pointers.push_back(&p);
+    auto quadratic = [&] {
+        var sum = 0;
+        for (size_t i = 0; i < params.size(); i++) {
+            var r = params[i] - 1;
+            sum = sum + double(i + 1) * r * r;
+        }
+        return sum;
+    };
+    optim::LBFGS<double> solver(pointers);
+    iterations = 0;
+    while (iterations < 100 && solver.step(quadratic) > 1e-12) iterations++;
+    CHECK(iterations < 40);
+    for (auto& p : params) CHECK(std::abs(p.raw() - 1) < 1e-5);
+}
+
+TEST_CASE("hessian-vector product") {
+    auto rosenbrock = [](const auto& x) {
+        auto r = x[1] - x[0] * x[0];
+        return (1 - x[0]) * (1 - x[0]) + 100 * r * r;
+    };
+    std::vector<double> x{0.5, 2}, v{1, 2}, grad(2), hv(2);
+    double f = hessian::hvp<double>(rosenbrock, x, v, grad, hv);
+    CHECK(almost_equal(f, 306.5));
+    CHECK(almost_equal(grad[0], -351));
+    CHECK(almost_equal(grad[1], 350));
+    // H = [[-498, -200], [-200, 200]]
+    CHECK(almost_equal(hv[0], -898));
+    CHECK(almost_equal(hv[1], 200));
+    CHECK(hessian::gradient<double>(rosenbrock, x, grad) == f);
+    CHECK(almost_equal(grad[0], -351));
+    CHECK(hessian::value<double>(rosenbrock, x) == f);
+
+    // sum (i + 1) (x_i - 1)^2 + x_i^4, plus (sum x_i)^2
+    auto loss = [](const auto& x) {
+        using V = std::remove_cvref_t<decltype(x[0])>;
+        V total = 0, sum = 0;
+        for (size_t i = 0; i < x.size(); i++) {
+            V r = x[i] - 1;
+            total = total + double(i + 1) * r * r + x[i] * x[i] * x[i] * x[i];
+            sum = sum + x[i];
+        }
+        return total + sum * sum;
+    };
+    std::vector<double> values(20), g(values.size());
+    optim::NewtonCG<double> newton(values.size());
+    for (int iter = 0; iter < 15; iter++) newton.step(loss, values);
+    hessian::gradient<double>(loss, values, g);
+    for (double gi : g) CHECK(std::abs(gi) < 1e-6);
 }
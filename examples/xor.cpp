@@ -74,6 +74,7 @@ public:
             std::vector<std::pair<std::pair<int, int>, int>> data = {
                 {{0, 0}, 0}, {{0, 1}, 1}, {{1, 0}, 1}, {{1, 1}, 0}};
             for (auto [x, y] : data) {
+                TapeArena<double>::Scope arena;
                 var output = this->forward(x.first, x.second);
                 var loss = -(y * log(output) + (1 - y) * log(1 - output));
                 loss.propagate();
@@ -86,6 +87,7 @@ public:
 int main() {
     XORModel model;
     model.fit(1000);
+    autodiff::no_grad guard;
     for (int x1 : {0, 1}) {
         for (int x2 : {0, 1}) {
             var output = model.forward(x1, x2);
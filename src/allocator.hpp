@@ -0,0 +1,132 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// Process-wide caching allocator for tensor buffers.
+//
+// Blocks are aligned to `alignment` bytes (a cache line, and the width of an AVX-512
+// register) and rounded up to a size class: multiples of 64 bytes up to 256, then four
+// classes per power of two, so that at most a fifth of a block is padding. A freed block
+// is kept on the free list of its class, threaded through the block itself, and handed
+// out again by the next allocation of that class; a training step that allocates the
+// same temporaries every iteration reaches a steady state where no allocation reaches
+// the system. `trim()` returns the cached blocks to the system.
+//
+// All methods are thread-safe. The pool is never destroyed, so that tensors with static
+// storage duration can outlive any other static.
+class BufferPool {
+public:
+    static constexpr size_t alignment = 64;
+
+    struct Stats {
+        size_t in_use{0};   // bytes in blocks handed out, padding included
+        size_t peak{0};     // highest `in_use` since the last `reset_peak()`
+        size_t cached{0};   // bytes in blocks on the free lists
+        size_t hits{0};     // allocations served from the free lists
+        size_t misses{0};   // allocations that went to the system
+    };
+
+private:
+    struct Block {
+        Block* next;
+    };
+    static constexpr size_t classes = 4 * 64;
+
+    std::mutex mutex;
+    std::array<Block*, classes> free_lists{};
+    Stats _stats;
+
+    BufferPool() = default;
+
+    // index of the size class for `bytes`, and the size of that class
+    static std::pair<size_t, size_t> size_class(size_t bytes) {
+        bytes = std::max<size_t>(bytes, 1);
+        if (bytes <= 4 * alignment) {
+            size_t i = (bytes + alignment - 1) / alignment;
+            return {i - 1, i * alignment};
+        }
+        size_t k = std::bit_width(bytes - 1), step = size_t(1) << (k - 3);
+        size_t j = (bytes + step - 1) / step - 4;  // 1..4 above 2^(k-1)
+        return {4 * (k - 8) + j - 1, (4 + j) * step};
+    }
+
+public:
+    static BufferPool& shared() {
+        static BufferPool* pool = new BufferPool;
+        return *pool;
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    void* allocate(size_t bytes) {
+        auto [i, size] = size_class(bytes);
+        {
+            std::lock_guard lock(mutex);
+            _stats.in_use += size;
+            _stats.peak = std::max(_stats.peak, _stats.in_use);
+            if (Block* block = free_lists[i]) {
+                free_lists[i] = block->next;
+                _stats.cached -= size, _stats.hits++;
+                return block;
+            }
+            _stats.misses++;
+        }
+        void* p = std::aligned_alloc(alignment, size);
+        if (p == nullptr) {
+            std::lock_guard lock(mutex);
+            _stats.in_use -= size;
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    // `bytes` is the size the block was allocated with
+    void deallocate(void* p, size_t bytes) {
+        auto [i, size] = size_class(bytes);
+        std::lock_guard lock(mutex);
+        auto block = static_cast<Block*>(p);
+        block->next = free_lists[i], free_lists[i] = block;
+        _stats.in_use -= size, _stats.cached += size;
+    }
+
+    Stats stats() {
+        std::lock_guard lock(mutex);
+        return _stats;
+    }
+    void reset_peak() {
+        std::lock_guard lock(mutex);
+        _stats.peak = _stats.in_use;
+    }
+
+    // free the cached blocks
+    void trim() {
+        std::lock_guard lock(mutex);
+        for (auto& head : free_lists) {
+            while (head != nullptr) std::free(std::exchange(head, head->next));
+        }
+        _stats.cached = 0;
+    }
+};
+
+// Standard allocator over `BufferPool`, for the containers and control blocks that go
+// with tensor buffers.
+template <typename T> struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U> PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= BufferPool::alignment);
+        return static_cast<T*>(BufferPool::shared().allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) { BufferPool::shared().deallocate(p, n * sizeof(T)); }
+
+    template <typename U> bool operator==(const PoolAllocator<U>&) const { return true; }
+};
@@ -0,0 +1,173 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+template <typename T> class TapeNode;
+
+// Per-thread bump allocator for tape nodes.
+//
+// Nodes are carved out of `chunk_size`-byte chunks that are aligned to their own size,
+// so the chunk owning a node is found by masking its address. Nodes created one after
+// another sit next to each other in memory. Freeing a node only decrements the live
+// count of its chunk; once a chunk holds no live node it is released in one shot
+// (rewound, or parked for reuse), which is what happens after `propagate()` tears down
+// the graph.
+//
+// Allocation only goes through the arena while a `TapeArena<T>::Scope` is alive on the
+// current thread; nodes must be freed on the thread that allocated them.
+template <typename T> class TapeArena {
+public:
+    static constexpr size_t chunk_size = 1 << 16;
+    static constexpr size_t max_free_chunks = 64;
+
+    class Scope {
+        TapeArena* prev;
+
+    public:
+        Scope() : prev(bound_arena) { bound_arena = &local(); }
+        ~Scope() { bound_arena = prev; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+private:
+    using Node = TapeNode<T>;
+    // a chunk is this header, a mark per slot (see `reverse_sweep`), then the slots
+    struct Chunk {
+        TapeArena* owner;
+        Chunk *prev, *next;
+        size_t used, live;
+    };
+    static constexpr size_t capacity() {
+        return (chunk_size - sizeof(Chunk) - alignof(Node)) /
+               (sizeof(unsigned) + sizeof(Node));
+    }
+    static constexpr size_t slots_offset() {
+        size_t end = sizeof(Chunk) + capacity() * sizeof(unsigned);
+        return (end + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+    }
+    static_assert(slots_offset() + capacity() * sizeof(Node) <= chunk_size);
+    static unsigned* marks(Chunk* chunk) {
+        auto header = reinterpret_cast<char*>(chunk);
+        return reinterpret_cast<unsigned*>(header + sizeof(Chunk));
+    }
+    static Node* slots(Chunk* chunk) {
+        return reinterpret_cast<Node*>(reinterpret_cast<char*>(chunk) + slots_offset());
+    }
+    static Chunk* chunk_of(const void* p) {
+        auto address = reinterpret_cast<uintptr_t>(p);
+        return reinterpret_cast<Chunk*>(address & ~(chunk_size - 1));
+    }
+
+    static inline thread_local TapeArena* bound_arena = nullptr;
+
+    // chunks in use, oldest first; `tail` is the one being bumped
+    Chunk *head{nullptr}, *tail{nullptr};
+    Chunk* free_list{nullptr};
+    size_t free_count{0};
+    unsigned epoch{0};  // of the last sweep
+
+    TapeArena() = default;
+
+    void unlink(Chunk* chunk) {
+        (chunk->prev ? chunk->prev->next : head) = chunk->next;
+        (chunk->next ? chunk->next->prev : tail) = chunk->prev;
+    }
+
+    void refill() {
+        Chunk* chunk = free_list;
+        if (chunk != nullptr) {
+            free_list = chunk->next, free_count--;
+        } else {
+            chunk = static_cast<Chunk*>(std::aligned_alloc(chunk_size, chunk_size));
+            if (chunk == nullptr) throw std::bad_alloc();
+        }
+        *chunk = Chunk{this, tail, nullptr, 0, 0};
+        (tail ? tail->next : head) = chunk;
+        tail = chunk;
+    }
+
+    void recycle(Chunk* chunk) {
+        chunk->used = 0;
+        if (chunk == tail) return;
+        unlink(chunk);
+        if (free_count == max_free_chunks) {
+            std::free(chunk);
+            return;
+        }
+        chunk->next = free_list, free_list = chunk, free_count++;
+    }
+
+public:
+    static TapeArena& local() {
+        thread_local TapeArena arena;
+        return arena;
+    }
+    static TapeArena* bound() { return bound_arena; }
+    // arena a pooled node was allocated from, nullptr once that thread has exited
+    static TapeArena* owner(const Node* node) { return chunk_of(node)->owner; }
+
+    // Visit `from`, then newest first the nodes marked along the way: `visit(node,
+    // mark)` may call `mark(other)` on nodes of this arena allocated before `node`. Only
+    // marked slots are read, so freed slots and the nodes of other graphs are skipped,
+    // and the walk stops at the oldest marked node rather than at the start of the arena.
+    template <typename F> static void reverse_sweep(Node* from, F&& visit) {
+        Chunk* chunk = chunk_of(from);
+        unsigned epoch = ++chunk->owner->epoch;
+        size_t pending = 0;  // marked nodes not visited yet
+        auto mark = [&](Node* node) {
+            Chunk* owner = chunk_of(node);
+            unsigned& m = marks(owner)[node - slots(owner)];
+            if (m != epoch) m = epoch, pending++;
+        };
+        mark(from);
+        size_t i = from - slots(chunk) + 1;
+        while (true) {
+            unsigned* m = marks(chunk);
+            Node* base = slots(chunk);
+            while (i) {
+                if (m[--i] != epoch) continue;
+                visit(base[i], mark);
+                if (--pending == 0) return;
+            }
+            chunk = chunk->prev;
+            i = chunk->used;
+        }
+    }
+
+    ~TapeArena() {
+        for (Chunk* chunk = head; chunk != nullptr;) {
+            Chunk* next = chunk->next;
+            if (chunk->live == 0)
+                std::free(chunk);
+            else
+                chunk->owner = nullptr;  // freed by the last node that leaves it
+            chunk = next;
+        }
+        while (free_list != nullptr) {
+            Chunk* next = free_list->next;
+            std::free(free_list);
+            free_list = next;
+        }
+    }
+    TapeArena(const TapeArena&) = delete;
+    TapeArena& operator=(const TapeArena&) = delete;
+
+    void* allocate() {
+        if (tail == nullptr || tail->used == capacity()) refill();
+        tail->live++;
+        marks(tail)[tail->used] = 0;
+        return slots(tail) + tail->used++;
+    }
+
+    static void release(void* p) {
+        Chunk* chunk = chunk_of(p);
+        if (--chunk->live) return;
+        if (chunk->owner == nullptr)
+            std::free(chunk);
+        else
+            chunk->owner->recycle(chunk);
+    }
+};
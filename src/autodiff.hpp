@@ -1,60 +1,283 @@
 #pragma once
+#include "arena.hpp"
 #include "util.hpp"
 
+#include <atomic>
+#include <concepts>
 #include <format>
 #include <iostream>
 #include <istream>
 #include <map>
+#include <new>
 #include <queue>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename T> class TapeNode;
+template <typename T, typename Op> struct StatefulOperation;
+
+namespace autodiff {
+// While a `no_grad` guard is alive on the current thread, arithmetic on `Variable`s only
+// computes values: no tape node is allocated and nothing can be propagated.
+class no_grad {
+    static inline thread_local int depth = 0;
 
-template <typename T> class Operation {
 public:
-    enum class OpType { unknown, unary, binary };
-    OpType op_type{OpType::unknown};
-    virtual std::string_view name() const = 0;
-    virtual T backward(const T& diff, const T& arg) const {
-        runtimeError("Not implemented");
+    no_grad() { depth++; }
+    ~no_grad() { depth--; }
+    no_grad(const no_grad&) = delete;
+    no_grad& operator=(const no_grad&) = delete;
+    static bool active() { return depth > 0; }
+};
+}  // namespace autodiff
+
+// Type-erased handle of an operation, stored on every tape node.
+//
+// Operations are structs with a `name` and `forward`/`backward` functions taking one
+// (unary) or two (binary) operands. `backward` may take the forward result as a trailing
+// argument, so derivatives that are a function of it need not recompute it.
+// `Operation<T>::of<Op>()` instantiates the glue between such a struct and the tape, so
+// running backward on a node is one direct call into code where the op's formula is
+// inlined: no virtual call, no switch over the kind of operation.
+//
+// Most operations are empty and their handle is shared by every node. An operation with
+// parameters (the axis of a reduction, a shape) keeps them as data members: `make` then
+// gives the node a handle of its own that carries a copy of the op, counted by the nodes
+// and programs using it.
+template <typename T> struct Operation {
+    std::string_view name;
+    void (*backward)(TapeNode<T>& node);
+    // value-level kernels, used to replay a recorded `Program`; unary ops ignore `rhs`
+    T (*forward)(const Operation& op, const T& lhs, const T& rhs);
+    std::tuple<T, T> (*adjoint)(const Operation& op, const T& diff, const T& lhs,
+                                const T& rhs, const T& out);
+    // reference counting of the handles made by `make`, null for the shared ones
+    void (*retain)(const Operation* op){nullptr};
+    void (*release)(const Operation* op){nullptr};
+
+    template <typename Op>
+    static constexpr bool unary = requires(const Op& op, const T& x) {
+        { op.forward(x) } -> std::convertible_to<T>;
+    };
+
+    // the op behind a handle of `Op`
+    template <typename Op> static decltype(auto) state(const Operation& op) {
+        if constexpr (std::is_empty_v<Op>)
+            return Op{};
+        else
+            return (static_cast<const StatefulOperation<T, Op>&>(op).state);
+    }
+
+    template <typename Op>
+    static auto call_backward(const Op& op, const T& diff, const T& out,
+                              const auto&... args) {
+        if constexpr (requires { op.backward(diff, args..., out); })
+            return op.backward(diff, args..., out);
+        else
+            return op.backward(diff, args...);
+    }
+
+    template <typename Op>
+    static T forward_of(const Operation& handle, const T& lhs, const T& rhs) {
+        decltype(auto) op = state<Op>(handle);
+        if constexpr (unary<Op>)
+            return op.forward(lhs);
+        else
+            return op.forward(lhs, rhs);
     }
-    virtual std::tuple<T, T> backward(const T& diff, const T& lhs, const T& rhs) const {
-        runtimeError("Not implemented");
+
+    template <typename Op>
+    static std::tuple<T, T> adjoint_of(const Operation& handle, const T& diff,
+                                       const T& lhs, const T& rhs, const T& out) {
+        decltype(auto) op = state<Op>(handle);
+        if constexpr (unary<Op>)
+            return {call_backward(op, diff, out, lhs), T{}};
+        else
+            return call_backward(op, diff, out, lhs, rhs);
     }
-    virtual T forward(const T& arg) const { runtimeError("Not implemented"); }
-    virtual T forward(const T& lhs, const T& rhs) const {
-        runtimeError("Not implemented");
+
+    // `target += diff`, where `target` is the gradient of a node of value `value`. Value
+    // types whose operands may be broadcast (e.g. `Tensor`) provide an `add_diff` that
+    // brings `diff` to the shape of `value`.
+    static void accumulate(T& target, const T& diff, const T& value) {
+        if constexpr (requires { add_diff(target, diff, value); })
+            add_diff(target, diff, value);
+        else
+            target += diff;
+    }
+
+    template <typename Op> static const Operation* of() {
+        static constexpr Operation op{Op::name, &TapeNode<T>::template backward<Op>,
+                                      &forward_of<Op>, &adjoint_of<Op>};
+        return &op;
+    }
+    // the handle of `op` for a new node, which owns one reference to it
+    template <typename Op> static const Operation* make(Op op) {
+        if constexpr (std::is_empty_v<Op>)
+            return of<Op>();
+        else
+            return new StatefulOperation<T, Op>(std::move(op));
+    }
+    static const Operation* acquire(const Operation* op) {
+        if (op != nullptr && op->retain != nullptr) op->retain(op);
+        return op;
+    }
+    static void drop(const Operation* op) {
+        if (op != nullptr && op->release != nullptr) op->release(op);
     }
 };
 
+// the handle of an operation with parameters, see `Operation::make`
+template <typename T, typename Op> struct StatefulOperation : Operation<T> {
+    Op state;
+    mutable int refs{1};
+    explicit StatefulOperation(Op op)
+        : Operation<T>(*Operation<T>::template of<Op>()), state(std::move(op)) {
+        this->retain = [](const Operation<T>* p) {
+            static_cast<const StatefulOperation*>(p)->refs++;
+        };
+        this->release = [](const Operation<T>* p) {
+            auto handle = static_cast<const StatefulOperation*>(p);
+            if (--handle->refs == 0) delete handle;
+        };
+    }
+};
+
+template <typename T> class Program;
+template <typename T> class DataParallel;
+namespace optim {
+template <typename T> class Parameters;
+}
+
 template <typename T> class TapeNode {
     const Operation<T>* const op{nullptr};
     TapeNode* lhs{nullptr};
     TapeNode* rhs{nullptr};
-    T _value{0}, _diff{0};
-    int _ref_count{0};
+    T _value{}, _diff{};
+    alignas(std::atomic_ref<int>::required_alignment) int _ref_count{0};
     bool _require_diff{true};
+    const bool _pooled{TapeArena<T>::bound() != nullptr};
+    // every interior ancestor lives in the same arena, so that reverse allocation order
+    // is a topological order of the graph (see `sweep`)
+    bool _linear{_pooled};
+
+    static inline thread_local std::vector<TapeNode*> pending;  // see `remove`
+
+    // Gradient sink of the current thread. Leaves with a slot (parameters registered
+    // with a `DataParallel`) accumulate into `sink[_slot]` instead of `_diff` while one
+    // is bound, so that workers never write to a shared node.
+    int _slot{-1};
+    static inline thread_local T* sink = nullptr;
+
+    // Leaves registered with an `optim::Parameters` keep their gradient in its buffer
+    // instead of `_diff`.
+    T* _grad{nullptr};
+
+    friend class Program<T>;
+    friend class DataParallel<T>;
+    friend class optim::Parameters<T>;
+
+    T& gradient() { return _grad != nullptr ? *_grad : _diff; }
+    void accumulate(const T& diff) {
+        T& target = _slot >= 0 && sink != nullptr ? sink[_slot] : gradient();
+        Operation<T>::accumulate(target, diff, _value);
+    }
+    // start a backward pass from this node
+    void seed(const T& initial_diff) {
+        gradient() = T{};
+        Operation<T>::accumulate(gradient(), initial_diff, _value);
+    }
+
+    bool linear_child(const TapeNode* child) const {
+        if (child == nullptr || child->op == nullptr) return true;
+        return child->_linear && TapeArena<T>::owner(child) == TapeArena<T>::owner(this);
+    }
+
+    // wide value types (e.g. `Lanes`) make the node over-aligned
+    static constexpr bool over_aligned =
+        alignof(TapeNode) > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    static void* heap_new(size_t size) {
+        if constexpr (over_aligned)
+            return ::operator new(size, std::align_val_t(alignof(TapeNode)));
+        else
+            return ::operator new(size);
+    }
+    static void heap_delete(void* p) {
+        if constexpr (over_aligned)
+            ::operator delete(p, std::align_val_t(alignof(TapeNode)));
+        else
+            ::operator delete(p);
+    }
 
 public:
+    static void* operator new(size_t size) {
+        if (auto arena = TapeArena<T>::bound()) return arena->allocate();
+        return heap_new(size);
+    }
+    static void operator delete(TapeNode* node, std::destroying_delete_t) {
+        bool pooled = node->_pooled;
+        node->~TapeNode();
+        if (pooled)
+            TapeArena<T>::release(node);
+        else
+            heap_delete(node);
+    }
+    static void operator delete(void* p) {  // only used when the constructor throws
+        if (TapeArena<T>::bound())
+            TapeArena<T>::release(p);
+        else
+            heap_delete(p);
+    }
+
+    // Leaves registered with a `DataParallel` are referenced by the graphs of several
+    // threads at once, their count is updated atomically. Every other node belongs to
+    // the graphs of a single thread and pays nothing for it.
     int ref_count() { return _ref_count; }
-    void add_ref() { _ref_count++; }
+    void add_ref() {
+        if (_slot >= 0)
+            std::atomic_ref(_ref_count).fetch_add(1, std::memory_order_relaxed);
+        else
+            _ref_count++;
+    }
+    // true if that was the last reference
+    bool drop_ref() {
+        if (_slot >= 0) {
+            auto count = std::atomic_ref(_ref_count);
+            return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+        return --_ref_count == 0;
+    }
     void remove_ref() {
-        _ref_count--;
-        if (_ref_count == 0) {
+        if (drop_ref()) {
             remove();
         }
     }
 
-    explicit TapeNode<T>(T value, Operation<T>* oper = nullptr,
+    // takes over a reference to `oper` (see `Operation::make`)
+    explicit TapeNode<T>(T value, const Operation<T>* oper = nullptr,
                          TapeNode<T>* left = nullptr, TapeNode<T>* right = nullptr)
-        : op(std::move(oper)), lhs(left), rhs(right), _value(value) {
-        if (left != nullptr) left->_ref_count++;
-        if (right != nullptr) right->_ref_count++;
+        : op(std::move(oper)), lhs(left), rhs(right), _value(std::move(value)) {
+        if (left != nullptr) left->add_ref();
+        if (right != nullptr) right->add_ref();
         this->_ref_count = 1;
+        if (_linear) _linear = linear_child(left) && linear_child(right);
+        if (oper != nullptr) {
+            _require_diff =
+                (left && left->_require_diff) || (right && right->_require_diff);
+        }
     }
+    ~TapeNode() { Operation<T>::drop(op); }
 
     T& value() { return _value; }
     const T& value() const { return _value; }
-    T diff() { return _diff; }
-    void clear() { _diff = 0; }
+    T diff() { return gradient(); }
+    void clear() { gradient() = T{}; }
+    // nodes whose operands all have it unset are skipped by `propagate`; set it on leaves
+    // before building the graph on top of them
     void require_diff(bool require_diff) { _require_diff = require_diff; }
+    bool require_diff() const { return _require_diff; }
 
     std::string id() const { return std::format("#{:02X}", ((size_t)this & 0xfff) >> 4); }
 
@@ -65,7 +288,7 @@ public:
 
     std::string to_string() const {
         return std::format("node(id: {}, func: {}, l/r: {}/{}, v: {}, d: {}, ref: {})",
-                           this->id(), op->name(), lhs ? lhs->id() : "   ",
+                           this->id(), op ? op->name : "leaf", lhs ? lhs->id() : "   ",
                            rhs ? rhs->id() : "   ", _value, _diff, _ref_count);
     }
 
@@ -78,60 +301,108 @@ public:
         return is;
     }
 
-    void propagate(T initial_diff) {
-        std::map<TapeNode*, int> deg;
-        auto find = [&](auto&& find, TapeNode* v) -> void {
-            if (deg.count(v)) return;
-            deg[v] = 0;
-            auto l = v->lhs, r = v->rhs;
-            if (l != nullptr) find(find, l), deg[l]++;
-            if (r != nullptr) find(find, r), deg[r]++;
+    // accumulate the adjoint of a node computed by `Op` into its operands
+    template <typename Op> static void backward(TapeNode& node) {
+        TapeNode *l = node.lhs, *r = node.rhs;
+        decltype(auto) operation = Operation<T>::template state<Op>(*node.op);
+        auto call = [&](const auto&... args) {
+            return Operation<T>::call_backward(operation, node._diff, node._value,
+                                               args...);
         };
-        find(find, this);
+        if constexpr (Operation<T>::template unary<Op>) {
+            l->accumulate(call(l->_value));
+        } else {
+            auto [dl, dr] = call(l->_value, r->_value);
+            if (l->_require_diff) l->accumulate(dl);
+            if (r->_require_diff) r->accumulate(dr);
+        }
+    }
+    void backward() { op->backward(*this); }
+
+    // Wengert-list engine: operands are always allocated before their users, so walking
+    // the arena backwards from this node visits the graph in topological order. Only the
+    // interior nodes reached from here are marked and visited (see `reverse_sweep`);
+    // leaves need no visit, and may live elsewhere or be shared with other threads.
+    void sweep(T initial_diff) {
+        seed(initial_diff);
+        TapeArena<T>::reverse_sweep(this, [](TapeNode& cur, auto&& mark) {
+            if (cur.op == nullptr || !cur._require_diff) return;
+            cur.backward();
+            if (cur.lhs->op != nullptr) mark(cur.lhs);
+            if (cur.rhs != nullptr && cur.rhs->op != nullptr) mark(cur.rhs);
+        });
+    }
+
+    void traverse(T initial_diff) {
+        std::map<TapeNode*, int> deg{{this, 0}};
+        std::vector<TapeNode*> stack{this};
+        while (stack.size()) {
+            TapeNode* v = stack.back();
+            stack.pop_back();
+            if (!v->_require_diff) continue;
+            for (auto child : {v->lhs, v->rhs}) {
+                if (child == nullptr) continue;
+                auto [it, fresh] = deg.try_emplace(child, 0);
+                if (fresh) stack.push_back(child);
+                it->second++;
+            }
+        }
         std::queue<TapeNode*> q;
-        this->_diff = initial_diff;
+        seed(initial_diff);
         q.push(this);
         while (q.size()) {
             TapeNode* cur = q.front();
             q.pop();
             TapeNode *l = cur->lhs, *r = cur->rhs;
-            if (!cur->op) continue;
-            switch (cur->op->op_type) {
-                case Operation<T>::OpType::unary:
-                    deg[l]--, l->_diff += cur->op->backward(cur->_diff, l->_value);
-                    break;
-                case Operation<T>::OpType::binary: {
-                    deg[l]--, deg[r]--;
-                    auto [dl, dr] = cur->op->backward(cur->_diff, l->_value, r->_value);
-                    l->_diff += dl, r->_diff += dr;
-                    break;
-                }
-                default: runtimeError("invalid op type");
-            }
+            if (!cur->op || !cur->_require_diff) continue;
+            cur->backward();
+            if (l != nullptr) deg[l]--;
+            if (r != nullptr) deg[r]--;
             if (l != nullptr && !deg[l]) q.push(l);
             if (r != nullptr && r != l && !deg[r]) q.push(r);
         }
     }
 
+    bool linear() const { return _linear && TapeArena<T>::owner(this) != nullptr; }
+
+    void propagate(T initial_diff) {
+        if (linear())
+            sweep(initial_diff);
+        else
+            traverse(initial_diff);
+    }
+
+    // Release the operands of this node, and transitively every node that is no longer
+    // referenced. Iterative, so that arbitrarily deep graphs can be torn down.
     void remove() {
-        for (auto& child : {lhs, rhs}) {
-            if (!child) continue;
-            child->remove_ref();
-            if (!child->ref_count()) {
-                delete child;
-            }
+        auto& stack = pending;
+        size_t base = stack.size();
+        auto release = [&](TapeNode*& child) {
+            if (child != nullptr && child->drop_ref()) stack.push_back(child);
+            child = nullptr;
+        };
+        release(lhs), release(rhs);
+        while (stack.size() > base) {
+            TapeNode* cur = stack.back();
+            stack.pop_back();
+            release(cur->lhs), release(cur->rhs);
+            delete cur;
         }
-        lhs = rhs = nullptr;
     }
 
     void print() {
-        std::cerr << std::format("{}", to_string()) << std::endl;
-        for (auto child : {lhs, rhs}) {
-            if (child) {
-                std::cerr << std::format("{0} ---{2}--> {1}\n", child->id(), id(),
-                                         op->name());
-                child->print();
+        // (node, user) pairs; the edge to `user` is printed right before the subgraph
+        std::vector<std::pair<TapeNode*, TapeNode*>> stack{{this, nullptr}};
+        while (stack.size()) {
+            auto [cur, user] = stack.back();
+            stack.pop_back();
+            if (user != nullptr) {
+                std::cerr << std::format("{0} ---{2}--> {1}\n", cur->id(), user->id(),
+                                         user->op->name);
             }
+            std::cerr << std::format("{}", cur->to_string()) << std::endl;
+            if (cur->rhs) stack.emplace_back(cur->rhs, cur);
+            if (cur->lhs) stack.emplace_back(cur->lhs, cur);
         }
     }
 };
@@ -145,46 +416,80 @@ template <typename T> class AutoDiff {
         }
     }
 
+    // value of a variable computed under `no_grad`, which has no node
+    T _value{};
+
+    // constants take part in a graph through a leaf that does not require diff
+    static TapeNode<T>* operand(const AutoDiff& v) {
+        if (v.node == nullptr) {
+            v.node = new TapeNode<T>(v._value);
+            v.node->require_diff(false);
+        }
+        return v.node;
+    }
+
 public:
-    TapeNode<T>* node;
-    const T& raw() const { return node->value(); }
-    T& raw() { return node->value(); }
-    T diff() const { return node->diff(); }
+    mutable TapeNode<T>* node{nullptr};
+    const T& raw() const { return node ? node->value() : _value; }
+    T& raw() { return node ? node->value() : _value; }
+    T diff() const { return node ? node->diff() : T{}; }
     virtual T initial_diff() const = 0;
-    void clear() { this->node->clear(); }
+    void clear() const {
+        if (node) node->clear();
+    }
 
-    AutoDiff<T>(T value) : node(new TapeNode<T>(value)) {}
+    // the value lives in the node if there is one
+    AutoDiff<T>(T value) {
+        if (autodiff::no_grad::active())
+            _value = std::move(value);
+        else
+            node = new TapeNode<T>(std::move(value));
+    }
     ~AutoDiff<T>() { delete_node(); }
-    AutoDiff<T>(const AutoDiff<T>& other) : node(other.node) { node->add_ref(); }
-    AutoDiff<T>(AutoDiff<T>&& other) noexcept : node(other.node) { other.node = nullptr; }
+    AutoDiff<T>(const AutoDiff<T>& other) : _value(other._value), node(other.node) {
+        if (node) node->add_ref();
+    }
+    AutoDiff<T>(AutoDiff<T>&& other) noexcept : _value(other._value), node(other.node) {
+        other.node = nullptr;
+    }
     AutoDiff<T>& operator=(const AutoDiff<T>& other) {
         if (this == &other) return *this;
         delete_node();
+        _value = other._value;
         node = other.node;
-        node->add_ref();
+        if (node) node->add_ref();
         return *this;
     }
     AutoDiff<T>& operator=(AutoDiff<T>&& other) noexcept {
         if (this == &other) return *this;
         delete_node();
+        _value = other._value;
         node = other.node;
         other.node = nullptr;
         return *this;
     }
-    AutoDiff<T>(Operation<T>* op, const auto&... args) {
-        node = new TapeNode<T>(op->forward((args.raw())...), op, (args.node)...);
+    template <typename Op> AutoDiff<T>(Op op, const auto&... args) {
+        if (autodiff::no_grad::active()) {
+            _value = op.forward((args.raw())...);
+            return;
+        }
+        T value = op.forward((args.raw())...);
+        node = new TapeNode<T>(std::move(value), Operation<T>::make(std::move(op)),
+                               operand(args)...);
     }
 
     void propagate(bool remain_graph = false) {
         if (node == nullptr) {
-            runtimeError("propagate nullptr");
+            runtimeError("propagate a variable without graph (computed under no_grad?)");
         }
         node->propagate(initial_diff());
         if (!remain_graph) {
             node->remove();
         }
     }
-    void require_diff(bool require_diff) { node->require_diff(require_diff); }
+    void require_diff(bool require_diff) {
+        if (node) node->require_diff(require_diff);
+    }
 
     template <typename... Args> auto derivative(const Args&... args) {
         propagate();
@@ -0,0 +1,135 @@
+#pragma once
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <format>
+
+// Forward mode: a value together with its directional derivatives along N directions.
+//
+// Arithmetic on `Dual`s applies the chain rule as it goes, so evaluating a function
+// templated on its number type (like `f<T>` in demo.cpp) with `Dual<double, N>`
+// arguments yields the function and N tangents in one pass, with no tape and no
+// allocation. Seed the inputs with `Dual::input(value, i)` to get the columns of the
+// Jacobian, or with arbitrary tangents for Jacobian-vector products. Comparisons look at
+// the value only.
+template <typename T, size_t N = 1> class Dual {
+    T _value{0};
+    std::array<T, N> _tangent{};
+
+    // result of an elementary function with value `value` and derivative `coef`
+    Dual chain(T value, T coef) const {
+        Dual r(value);
+        for (size_t i = 0; i < N; i++) r._tangent[i] = coef * _tangent[i];
+        return r;
+    }
+
+public:
+    Dual(T value = 0) : _value(value) {}
+    Dual(T value, const std::array<T, N>& tangent) : _value(value), _tangent(tangent) {}
+
+    // the i-th of N independent inputs
+    static Dual input(T value, size_t i) {
+        Dual r(value);
+        r._tangent[i] = 1;
+        return r;
+    }
+
+    const T& raw() const { return _value; }
+    T& raw() { return _value; }
+    const std::array<T, N>& tangent() const { return _tangent; }
+    std::array<T, N>& tangent() { return _tangent; }
+    T diff(size_t i = 0) const { return _tangent[i]; }
+
+    friend Dual operator+(const Dual& v) { return v; }
+    friend Dual operator-(const Dual& v) { return v.chain(-v._value, -1); }
+    friend Dual operator+(const Dual& a, const Dual& b) {
+        Dual r(a._value + b._value);
+        for (size_t i = 0; i < N; i++) r._tangent[i] = a._tangent[i] + b._tangent[i];
+        return r;
+    }
+    friend Dual operator-(const Dual& a, const Dual& b) {
+        Dual r(a._value - b._value);
+        for (size_t i = 0; i < N; i++) r._tangent[i] = a._tangent[i] - b._tangent[i];
+        return r;
+    }
+    friend Dual operator*(const Dual& a, const Dual& b) {
+        Dual r(a._value * b._value);
+        for (size_t i = 0; i < N; i++)
+            r._tangent[i] = a._tangent[i] * b._value + a._value * b._tangent[i];
+        return r;
+    }
+    friend Dual operator/(const Dual& a, const Dual& b) {
+        Dual r(a._value / b._value);
+        for (size_t i = 0; i < N; i++)
+            r._tangent[i] = (a._tangent[i] - r._value * b._tangent[i]) / b._value;
+        return r;
+    }
+    Dual& operator+=(const Dual& b) { return *this = *this + b; }
+    Dual& operator-=(const Dual& b) { return *this = *this - b; }
+    Dual& operator*=(const Dual& b) { return *this = *this * b; }
+    Dual& operator/=(const Dual& b) { return *this = *this / b; }
+
+    friend bool operator==(const Dual& a, const Dual& b) { return a._value == b._value; }
+    friend auto operator<=>(const Dual& a, const Dual& b) {
+        return a._value <=> b._value;
+    }
+
+    friend Dual log(const Dual& v) { return v.chain(std::log(v._value), 1 / v._value); }
+    friend Dual exp(const Dual& v) {
+        T e = std::exp(v._value);
+        return v.chain(e, e);
+    }
+    friend Dual sin(const Dual& v) {
+        return v.chain(std::sin(v._value), std::cos(v._value));
+    }
+    friend Dual cos(const Dual& v) {
+        return v.chain(std::cos(v._value), -std::sin(v._value));
+    }
+    friend Dual tan(const Dual& v) {
+        T c = std::cos(v._value);
+        return v.chain(std::tan(v._value), 1 / (c * c));
+    }
+    friend Dual asin(const Dual& v) {
+        return v.chain(std::asin(v._value), 1 / std::sqrt(1 - v._value * v._value));
+    }
+    friend Dual acos(const Dual& v) {
+        return v.chain(std::acos(v._value), -1 / std::sqrt(1 - v._value * v._value));
+    }
+    friend Dual atan(const Dual& v) {
+        return v.chain(std::atan(v._value), 1 / (1 + v._value * v._value));
+    }
+    friend Dual sinh(const Dual& v) {
+        return v.chain(std::sinh(v._value), std::cosh(v._value));
+    }
+    friend Dual cosh(const Dual& v) {
+        return v.chain(std::cosh(v._value), std::sinh(v._value));
+    }
+    friend Dual tanh(const Dual& v) {
+        T t = std::tanh(v._value);
+        return v.chain(t, 1 - t * t);
+    }
+    friend Dual sqrt(const Dual& v) {
+        T s = std::sqrt(v._value);
+        return v.chain(s, 0.5 / s);
+    }
+    friend Dual abs(const Dual& v) {
+        return v.chain(std::abs(v._value), v._value >= 0 ? 1 : -1);
+    }
+    friend Dual pow(const Dual& a, const Dual& b) {
+        T out = std::pow(a._value, b._value);
+        Dual r = a.chain(out, b._value * std::pow(a._value, b._value - 1));
+        // the log term is only defined for positive bases; skip it for constant exponents
+        bool constant = true;
+        for (auto t : b._tangent) constant = constant && t == 0;
+        if (constant) return r;
+        T coef = out * std::log(a._value);
+        for (size_t i = 0; i < N; i++) r._tangent[i] += coef * b._tangent[i];
+        return r;
+    }
+};
+
+template <typename T, size_t N> struct std::formatter<Dual<T, N>> : std::formatter<T> {
+    auto format(const Dual<T, N>& v, std::format_context& ctx) const {
+        return std::formatter<T>::format(v.raw(), ctx);
+    }
+};
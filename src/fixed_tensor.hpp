@@ -0,0 +1,201 @@
+#pragma once
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <format>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
+
+// Tensor whose shape is part of its type: `Tensor<double, 4, 4>` is a 4x4 matrix.
+//
+// The elements are stored inline, row-major, so a fixed-shape tensor lives on the stack
+// and copies like a `std::array`. Shape and strides are compile-time constants: indexing
+// with constant indices is a constant offset, and element-wise loops and products have
+// constant trip counts that the compiler unrolls. Arithmetic, comparisons, math
+// functions and `matmul` are spelled as for `Tensor<T>`; operands have the same shape,
+// and a scalar converts to a tensor filled with it. `dynamic()` and the explicit
+// constructor from a `Tensor<T>` convert between the two.
+template <typename T, size_t... Dims> class Tensor {
+    static_assert(sizeof...(Dims) > 0 && ((Dims > 0) && ...));
+
+public:
+    static constexpr size_t rank = sizeof...(Dims);
+    static constexpr size_t count = (Dims * ...);
+    static constexpr std::array<size_t, rank> dims{Dims...};
+    static constexpr std::array<size_t, rank> strides = [] {
+        std::array<size_t, rank> strides{};
+        size_t stride = 1;
+        for (size_t i = rank; i--;) strides[i] = stride, stride *= dims[i];
+        return strides;
+    }();
+
+private:
+    std::array<T, count> _data{};
+
+    template <typename, size_t...> friend class Tensor;
+
+public:
+    static constexpr size_t offset(std::convertible_to<size_t> auto... idx) {
+        size_t index = 0, i = 0;
+        ((index += size_t(idx) * strides[i++]), ...);
+        return index;
+    }
+
+    static Shape shape() { return Shape(dims.begin(), dims.end()); }
+    static constexpr size_t size() { return count; }
+    const T* data() const { return _data.data(); }
+    T* data() { return _data.data(); }
+
+    constexpr Tensor() = default;
+    constexpr Tensor(T value) { _data.fill(value); }
+    // the elements in row-major order
+    Tensor(std::initializer_list<T> values) {
+        if (values.size() != count)
+            runtimeError("{} values for a tensor of shape {}", values.size(), shape());
+        std::copy(values.begin(), values.end(), _data.begin());
+    }
+    explicit Tensor(const Tensor<T>& other) {
+        if (other.shape() != shape())
+            runtimeError("can not convert a tensor of shape {} to {}", other.shape(),
+                         shape());
+        Tensor<T> elements = other.contiguous();
+        std::copy_n(elements.data(), count, _data.begin());
+    }
+    Tensor<T> dynamic() const {
+        Tensor<T> out(shape());
+        std::copy(_data.begin(), _data.end(), out.data());
+        return out;
+    }
+
+    template <typename... I>
+        requires(sizeof...(I) == rank)
+    auto& operator[](this auto& self, I... idx) {
+        return self._data[offset(idx...)];
+    }
+
+    static Tensor zeros() { return Tensor(); }
+    static Tensor ones() { return Tensor(T(1)); }
+
+    template <typename F> auto map(F&& f) const {
+        using R = std::remove_cvref_t<std::invoke_result_t<F&, const T&>>;
+        Tensor<R, Dims...> out;
+        for (size_t i = 0; i < count; i++) out._data[i] = f(_data[i]);
+        return out;
+    }
+    template <typename F> static auto zip(F&& f, const Tensor& a, const Tensor& b) {
+        using R = std::remove_cvref_t<std::invoke_result_t<F&, const T&, const T&>>;
+        Tensor<R, Dims...> out;
+        for (size_t i = 0; i < count; i++) out._data[i] = f(a._data[i], b._data[i]);
+        return out;
+    }
+
+    friend Tensor operator-(const Tensor& a) { return a.map(std::negate<>()); }
+    friend Tensor operator+(const Tensor& a, const Tensor& b) {
+        return zip(std::plus<>(), a, b);
+    }
+    friend Tensor operator-(const Tensor& a, const Tensor& b) {
+        return zip(std::minus<>(), a, b);
+    }
+    friend Tensor operator*(const Tensor& a, const Tensor& b) {
+        return zip(std::multiplies<>(), a, b);
+    }
+    friend Tensor operator/(const Tensor& a, const Tensor& b) {
+        return zip(std::divides<>(), a, b);
+    }
+    // `==` compares whole tensors, the others element by element
+    friend bool operator==(const Tensor& a, const Tensor& b) {
+        return a._data == b._data;
+    }
+    friend Tensor<bool, Dims...> operator<(const Tensor& a, const Tensor& b) {
+        return zip(std::less<>(), a, b);
+    }
+    friend Tensor<bool, Dims...> operator<=(const Tensor& a, const Tensor& b) {
+        return zip(std::less_equal<>(), a, b);
+    }
+    friend Tensor<bool, Dims...> operator>(const Tensor& a, const Tensor& b) {
+        return zip(std::greater<>(), a, b);
+    }
+    friend Tensor<bool, Dims...> operator>=(const Tensor& a, const Tensor& b) {
+        return zip(std::greater_equal<>(), a, b);
+    }
+
+#define TENSOR_UNARY_FUNC(func)                                                   \
+    friend Tensor func(const Tensor& a) {                                         \
+        return a.map([](const T& x) -> T { return std::func(x); });               \
+    }
+    TENSOR_UNARY_FUNC(log)
+    TENSOR_UNARY_FUNC(exp)
+    TENSOR_UNARY_FUNC(sin)
+    TENSOR_UNARY_FUNC(cos)
+    TENSOR_UNARY_FUNC(tan)
+    TENSOR_UNARY_FUNC(asin)
+    TENSOR_UNARY_FUNC(acos)
+    TENSOR_UNARY_FUNC(atan)
+    TENSOR_UNARY_FUNC(sinh)
+    TENSOR_UNARY_FUNC(cosh)
+    TENSOR_UNARY_FUNC(tanh)
+    TENSOR_UNARY_FUNC(sqrt)
+    TENSOR_UNARY_FUNC(abs)
+#undef TENSOR_UNARY_FUNC
+    friend Tensor pow(const Tensor& a, const Tensor& b) {
+        return zip([](const T& x, const T& y) -> T { return std::pow(x, y); }, a, b);
+    }
+
+    Tensor& operator+=(const Tensor& other) {
+        for (size_t i = 0; i < count; i++) _data[i] += other._data[i];
+        return *this;
+    }
+
+    T sum() const {
+        T total{};
+        for (const T& x : _data) total += x;
+        return total;
+    }
+    T item() const
+        requires(count == 1)
+    {
+        return _data[0];
+    }
+
+    auto transpose() const
+        requires(rank == 2)
+    {
+        Tensor<T, dims[1], dims[0]> out;
+        for (size_t i = 0; i < dims[0]; i++)
+            for (size_t j = 0; j < dims[1]; j++) out[j, i] = (*this)[i, j];
+        return out;
+    }
+
+    std::string toString() const {
+        auto elements = ::toString(_data.begin(), _data.end());
+        return std::format("tensor({}, {})", shape(), elements);
+    }
+};
+
+// (m, k) x (k, n) -> (m, n)
+template <typename T, size_t M, size_t K, size_t N>
+Tensor<T, M, N> matmul(const Tensor<T, M, K>& lhs, const Tensor<T, K, N>& rhs) {
+    Tensor<T, M, N> out;
+    for (size_t i = 0; i < M; i++) {
+        for (size_t p = 0; p < K; p++) {
+            T x = lhs[i, p];
+            for (size_t j = 0; j < N; j++) out[i, j] += x * rhs[p, j];
+        }
+    }
+    return out;
+}
+
+// (m, k) x (k) -> (m)
+template <typename T, size_t M, size_t K>
+Tensor<T, M> matmul(const Tensor<T, M, K>& lhs, const Tensor<T, K>& rhs) {
+    Tensor<T, M> out;
+    for (size_t i = 0; i < M; i++) {
+        for (size_t p = 0; p < K; p++) out[i] += lhs[i, p] * rhs[p];
+    }
+    return out;
+}
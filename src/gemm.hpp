@@ -0,0 +1,150 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#if defined(__AVX2__) && defined(__FMA__)
+#    include <immintrin.h>
+#endif
+
+// General matrix multiply, C += A * B, on strided matrices.
+//
+// Blocked the GotoBLAS way: B is cut into kc x nc blocks and A into mc x kc blocks that
+// fit in L2 and L1, and both are packed into contiguous panels of `nr` columns and `mr`
+// rows (zero padded), so that the micro-kernel streams through memory linearly while
+// it keeps an mr x nr tile of C in registers. Element (i, j) of a matrix is at
+// `data[i * rs + j * cs]`, which covers transposed and sliced tensors; C must have unit
+// column stride.
+//
+// The AVX2/FMA micro-kernels are compiled in when the target supports them (e.g.
+// `-march=native`, see the NATIVE_ARCH option in CMakeLists.txt); otherwise, and for
+// other element types, a portable kernel is used.
+namespace gemm {
+inline constexpr size_t kc = 256, mc = 96, nc = 2048;
+
+template <typename T> struct Kernel {
+    static constexpr size_t mr = 4, nr = 4;
+    static void run(size_t k, const T* a, const T* b, T* c, size_t rsc) {
+        T acc[mr][nr] = {};
+        for (size_t p = 0; p < k; p++, a += mr, b += nr) {
+            for (size_t i = 0; i < mr; i++)
+                for (size_t j = 0; j < nr; j++) acc[i][j] += a[i] * b[j];
+        }
+        for (size_t i = 0; i < mr; i++)
+            for (size_t j = 0; j < nr; j++) c[i * rsc + j] += acc[i][j];
+    }
+};
+
+#if defined(__AVX2__) && defined(__FMA__)
+template <> struct Kernel<double> {
+    static constexpr size_t mr = 6, nr = 8;
+    static void run(size_t k, const double* a, const double* b, double* c, size_t rsc) {
+        __m256d acc[mr][2];
+        for (auto& row : acc) row[0] = row[1] = _mm256_setzero_pd();
+        for (size_t p = 0; p < k; p++, a += mr, b += nr) {
+            __m256d b0 = _mm256_loadu_pd(b), b1 = _mm256_loadu_pd(b + 4);
+            for (size_t i = 0; i < mr; i++) {
+                __m256d ai = _mm256_broadcast_sd(a + i);
+                acc[i][0] = _mm256_fmadd_pd(ai, b0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_pd(ai, b1, acc[i][1]);
+            }
+        }
+        for (size_t i = 0; i < mr; i++) {
+            double* ci = c + i * rsc;
+            _mm256_storeu_pd(ci, _mm256_add_pd(_mm256_loadu_pd(ci), acc[i][0]));
+            _mm256_storeu_pd(ci + 4, _mm256_add_pd(_mm256_loadu_pd(ci + 4), acc[i][1]));
+        }
+    }
+};
+
+template <> struct Kernel<float> {
+    static constexpr size_t mr = 6, nr = 16;
+    static void run(size_t k, const float* a, const float* b, float* c, size_t rsc) {
+        __m256 acc[mr][2];
+        for (auto& row : acc) row[0] = row[1] = _mm256_setzero_ps();
+        for (size_t p = 0; p < k; p++, a += mr, b += nr) {
+            __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+            for (size_t i = 0; i < mr; i++) {
+                __m256 ai = _mm256_broadcast_ss(a + i);
+                acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+            }
+        }
+        for (size_t i = 0; i < mr; i++) {
+            float* ci = c + i * rsc;
+            _mm256_storeu_ps(ci, _mm256_add_ps(_mm256_loadu_ps(ci), acc[i][0]));
+            _mm256_storeu_ps(ci + 8, _mm256_add_ps(_mm256_loadu_ps(ci + 8), acc[i][1]));
+        }
+    }
+};
+#endif
+
+// rows [0, m) of a k-column block, as panels of mr rows: panel-major, then k, then row
+template <typename T>
+void pack_a(size_t m, size_t k, const T* a, size_t rs, size_t cs, T* out) {
+    constexpr size_t mr = Kernel<T>::mr;
+    for (size_t i0 = 0; i0 < m; i0 += mr) {
+        for (size_t p = 0; p < k; p++) {
+            for (size_t i = i0; i < i0 + mr; i++) {
+                *out++ = i < m ? a[i * rs + p * cs] : T(0);
+            }
+        }
+    }
+}
+
+// columns [0, n) of a k-row block, as panels of nr columns: panel-major, then k, then
+// column
+template <typename T>
+void pack_b(size_t k, size_t n, const T* b, size_t rs, size_t cs, T* out) {
+    constexpr size_t nr = Kernel<T>::nr;
+    for (size_t j0 = 0; j0 < n; j0 += nr) {
+        for (size_t p = 0; p < k; p++) {
+            for (size_t j = j0; j < j0 + nr; j++) {
+                *out++ = j < n ? b[p * rs + j * cs] : T(0);
+            }
+        }
+    }
+}
+
+// C (m x n, row stride rsc) += A (m x k) * B (k x n)
+template <typename T>
+void multiply(size_t m, size_t n, size_t k, const T* a, size_t rsa, size_t csa,
+              const T* b, size_t rsb, size_t csb, T* c, size_t rsc) {
+    using K = Kernel<T>;
+    constexpr size_t mr = K::mr, nr = K::nr;
+    static_assert(mc % mr == 0 && nc % nr == 0);
+    // packing buffers are reused across calls on the same thread
+    static thread_local std::vector<T> a_pack, b_pack;
+    a_pack.resize(mc * kc), b_pack.resize(kc * nc);
+
+    for (size_t jc = 0; jc < n; jc += nc) {
+        size_t nb = std::min(nc, n - jc);
+        for (size_t pc = 0; pc < k; pc += kc) {
+            size_t kb = std::min(kc, k - pc);
+            pack_b(kb, nb, b + pc * rsb + jc * csb, rsb, csb, b_pack.data());
+            for (size_t ic = 0; ic < m; ic += mc) {
+                size_t mb = std::min(mc, m - ic);
+                pack_a(mb, kb, a + ic * rsa + pc * csa, rsa, csa, a_pack.data());
+                for (size_t jr = 0; jr < nb; jr += nr) {
+                    for (size_t ir = 0; ir < mb; ir += mr) {
+                        const T* ap = a_pack.data() + ir * kb;
+                        const T* bp = b_pack.data() + jr * kb;
+                        T* cp = c + (ic + ir) * rsc + jc + jr;
+                        size_t mm = std::min(mr, mb - ir), nn = std::min(nr, nb - jr);
+                        if (mm == mr && nn == nr) {
+                            K::run(kb, ap, bp, cp, rsc);
+                            continue;
+                        }
+                        // partial tile at the border: compute in full, add what fits
+                        T tile[mr * nr] = {};
+                        K::run(kb, ap, bp, tile, nr);
+                        for (size_t i = 0; i < mm; i++) {
+                            for (size_t j = 0; j < nn; j++)
+                                cp[i * rsc + j] += tile[i * nr + j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+}  // namespace gemm
@@ -0,0 +1,58 @@
+#pragma once
+#include "arena.hpp"
+#include "dual.hpp"
+#include "variable.hpp"
+
+#include <cstddef>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Second derivatives, forward over reverse.
+//
+// A function `f` of n inputs is written once, generic over the value type: it takes a
+// `const std::vector<Variable<U>>&` and returns a `Variable<U>` (a generic lambda does).
+// `gradient` runs it on `Variable<T>`. `hvp` runs it on `Variable<Dual<T>>`, with the
+// direction v as the tangents of the inputs: the backward formulas then carry tangents
+// too, and the adjoint of input i comes out as a dual whose value is df/dx_i and whose
+// tangent is (Hv)_i. One Hessian-vector product costs a small constant factor over a
+// gradient and never forms the Hessian.
+namespace hessian {
+
+// f(x), with the gradient into `grad`
+template <typename T, typename F>
+T gradient(F&& f, std::span<const T> x, std::span<T> grad) {
+    typename TapeArena<T>::Scope arena;
+    std::vector<Variable<T>> inputs(x.begin(), x.end());
+    Variable<T> y = f(std::as_const(inputs));
+    y.propagate();
+    for (size_t i = 0; i < x.size(); i++) grad[i] = inputs[i].diff();
+    return y.raw();
+}
+
+// f(x), with the gradient into `grad` and the product of the Hessian with `v` into `hv`
+template <typename T, typename F>
+T hvp(F&& f, std::span<const T> x, std::span<const T> v, std::span<T> grad,
+      std::span<T> hv) {
+    using D = Dual<T>;
+    typename TapeArena<D>::Scope arena;
+    std::vector<Variable<D>> inputs;
+    inputs.reserve(x.size());
+    for (size_t i = 0; i < x.size(); i++) inputs.emplace_back(D(x[i], {v[i]}));
+    Variable<D> y = f(std::as_const(inputs));
+    y.propagate();
+    for (size_t i = 0; i < x.size(); i++) {
+        D g = inputs[i].diff();
+        grad[i] = g.raw(), hv[i] = g.diff();
+    }
+    return y.raw().raw();
+}
+
+// f(x) alone, without building a graph
+template <typename T, typename F> T value(F&& f, std::span<const T> x) {
+    autodiff::no_grad guard;
+    std::vector<Variable<T>> inputs(x.begin(), x.end());
+    return f(std::as_const(inputs)).raw();
+}
+
+}  // namespace hessian
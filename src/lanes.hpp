@@ -0,0 +1,151 @@
+#pragma once
+#include "util.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <format>
+#include <initializer_list>
+
+// N values of type T packed side by side, with element-wise arithmetic and math.
+//
+// Used as the value type of a tape, `Variable<Lanes<double, N>>` evaluates one graph for
+// a batch of N inputs: every node carries N values and N adjoints, and each forward or
+// backward step is a loop over the lanes that the compiler turns into vector
+// instructions (AVX2/AVX-512 when enabled with `-march`). Comparisons are per lane and
+// yield a `Lanes<bool, N>` mask; branches in formulas go through `where`.
+template <typename T, size_t N> class Lanes {
+    // aligned to the vector width when it is a power of two, up to a cache line
+    static constexpr size_t bytes = N * sizeof(T);
+    static constexpr size_t align =
+        bytes >= 64 ? 64 : (bytes & (bytes - 1)) ? alignof(T) : bytes;
+    alignas(align) std::array<T, N> v;
+
+    template <typename F> static Lanes map(F&& f, const Lanes& a) {
+        Lanes r;
+        for (size_t i = 0; i < N; i++) r.v[i] = f(a.v[i]);
+        return r;
+    }
+    template <typename F> static Lanes map(F&& f, const Lanes& a, const Lanes& b) {
+        Lanes r;
+        for (size_t i = 0; i < N; i++) r.v[i] = f(a.v[i], b.v[i]);
+        return r;
+    }
+    template <typename F>
+    static Lanes<bool, N> test(F&& f, const Lanes& a, const Lanes& b) {
+        Lanes<bool, N> r;
+        for (size_t i = 0; i < N; i++) r[i] = f(a.v[i], b.v[i]);
+        return r;
+    }
+
+public:
+    Lanes() : v{} {}
+    Lanes(T value) { v.fill(value); }
+    // missing lanes are zero
+    Lanes(std::initializer_list<T> values) : v{} {
+        if (values.size() > N) runtimeError("{} values for {} lanes", values.size(), N);
+        std::copy(values.begin(), values.end(), v.begin());
+    }
+
+    static constexpr size_t size() { return N; }
+    T& operator[](size_t i) { return v[i]; }
+    const T& operator[](size_t i) const { return v[i]; }
+    auto begin() const { return v.begin(); }
+    auto end() const { return v.end(); }
+
+    bool all() const {
+        for (auto x : v)
+            if (!x) return false;
+        return true;
+    }
+    bool any() const {
+        for (auto x : v)
+            if (x) return true;
+        return false;
+    }
+    T sum() const {
+        T s = 0;
+        for (auto x : v) s += x;
+        return s;
+    }
+
+    friend Lanes operator-(const Lanes& a) { return map([](T x) { return -x; }, a); }
+    friend Lanes operator+(const Lanes& a, const Lanes& b) {
+        return map([](T x, T y) { return x + y; }, a, b);
+    }
+    friend Lanes operator-(const Lanes& a, const Lanes& b) {
+        return map([](T x, T y) { return x - y; }, a, b);
+    }
+    friend Lanes operator*(const Lanes& a, const Lanes& b) {
+        return map([](T x, T y) { return x * y; }, a, b);
+    }
+    friend Lanes operator/(const Lanes& a, const Lanes& b) {
+        return map([](T x, T y) { return x / y; }, a, b);
+    }
+    Lanes& operator+=(const Lanes& b) { return *this = *this + b; }
+    Lanes& operator-=(const Lanes& b) { return *this = *this - b; }
+    Lanes& operator*=(const Lanes& b) { return *this = *this * b; }
+    Lanes& operator/=(const Lanes& b) { return *this = *this / b; }
+
+    friend Lanes<bool, N> operator==(const Lanes& a, const Lanes& b) {
+        return test([](T x, T y) { return x == y; }, a, b);
+    }
+    friend Lanes<bool, N> operator!=(const Lanes& a, const Lanes& b) {
+        return test([](T x, T y) { return x != y; }, a, b);
+    }
+    friend Lanes<bool, N> operator<(const Lanes& a, const Lanes& b) {
+        return test([](T x, T y) { return x < y; }, a, b);
+    }
+    friend Lanes<bool, N> operator<=(const Lanes& a, const Lanes& b) {
+        return test([](T x, T y) { return x <= y; }, a, b);
+    }
+    friend Lanes<bool, N> operator>(const Lanes& a, const Lanes& b) { return b < a; }
+    friend Lanes<bool, N> operator>=(const Lanes& a, const Lanes& b) { return b <= a; }
+
+#define LANES_UNARY_FUNC(func) \
+    friend Lanes func(const Lanes& a) { return map([](T x) { return std::func(x); }, a); }
+    LANES_UNARY_FUNC(log)
+    LANES_UNARY_FUNC(exp)
+    LANES_UNARY_FUNC(sin)
+    LANES_UNARY_FUNC(cos)
+    LANES_UNARY_FUNC(tan)
+    LANES_UNARY_FUNC(asin)
+    LANES_UNARY_FUNC(acos)
+    LANES_UNARY_FUNC(atan)
+    LANES_UNARY_FUNC(sinh)
+    LANES_UNARY_FUNC(cosh)
+    LANES_UNARY_FUNC(tanh)
+    LANES_UNARY_FUNC(sqrt)
+    LANES_UNARY_FUNC(abs)
+#undef LANES_UNARY_FUNC
+    friend Lanes pow(const Lanes& a, const Lanes& b) {
+        return map([](T x, T y) { return std::pow(x, y); }, a, b);
+    }
+};
+
+// per-lane `cond ? then() : otherwise()`; a branch only runs if some lane takes it
+template <size_t N, typename F, typename G>
+auto where(const Lanes<bool, N>& cond, F&& then, G&& otherwise) {
+    if (cond.all()) return then();
+    if (!cond.any()) return otherwise();
+    auto a = then(), b = otherwise();
+    for (size_t i = 0; i < N; i++)
+        if (!cond[i]) a[i] = b[i];
+    return a;
+}
+
+template <typename T, size_t N>
+struct std::formatter<Lanes<T, N>> : std::formatter<T> {
+    auto format(const Lanes<T, N>& lanes, std::format_context& ctx) const {
+        auto out = ctx.out();
+        *out++ = '[';
+        for (size_t i = 0; i < N; i++) {
+            if (i) *out++ = ',', *out++ = ' ';
+            ctx.advance_to(out);
+            out = std::formatter<T>::format(lanes[i], ctx);
+        }
+        *out++ = ']';
+        return out;
+    }
+};
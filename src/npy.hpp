@@ -0,0 +1,217 @@
+#pragma once
+#include "tensor.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Tensors in NumPy's .npy format.
+//
+// `load` maps the file into memory and returns a view of the elements in place, so
+// opening a file costs no read and no copy however large it is, pages are read on first
+// touch, and processes loading the same file share its pages through the page cache. The
+// mapping is read-only: the first write to the tensor, or to a view of it, copies its
+// elements out of the mapping (see `Storage::detach`), and the file never changes. The
+// mapping lives as long as any tensor looking into it; copying the view copies its
+// elements, as for any view.
+//
+// The element type of the file must be `T`, in native byte order; Fortran-ordered files
+// load as column-major views.
+namespace npy {
+
+static_assert(std::endian::native == std::endian::little, "npy: big-endian host");
+
+// the `descr` of `T` in an .npy header, such as "<f8" for double
+template <typename T> constexpr std::string_view descr() {
+    if constexpr (std::is_same_v<T, bool>) return "|b1";
+    else if constexpr (std::is_same_v<T, float>) return "<f4";
+    else if constexpr (std::is_same_v<T, double>) return "<f8";
+    else if constexpr (std::is_same_v<T, int8_t>) return "|i1";
+    else if constexpr (std::is_same_v<T, uint8_t>) return "|u1";
+    else if constexpr (std::is_same_v<T, int16_t>) return "<i2";
+    else if constexpr (std::is_same_v<T, uint16_t>) return "<u2";
+    else if constexpr (std::is_same_v<T, int32_t>) return "<i4";
+    else if constexpr (std::is_same_v<T, uint32_t>) return "<u4";
+    else if constexpr (std::is_same_v<T, int64_t>) return "<i8";
+    else if constexpr (std::is_same_v<T, uint64_t>) return "<u8";
+    else static_assert(false, "npy: no dtype for this element type");
+}
+
+inline constexpr std::string_view magic = "\x93NUMPY";
+
+struct Header {
+    std::string descr;
+    bool fortran_order{false};
+    Shape shape;
+    size_t data_offset{0};  // bytes from the start of the file to the first element
+};
+
+// Parse the header at the start of `bytes`, a dictionary written as a Python literal:
+// {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), }
+inline Header parse_header(std::string_view bytes) {
+    if (bytes.size() < 10 || bytes.substr(0, magic.size()) != magic)
+        runtimeError("npy: not an .npy file");
+    unsigned char major = bytes[6];
+    size_t length, start;
+    if (major == 1) {
+        length = uint8_t(bytes[8]) | size_t(uint8_t(bytes[9])) << 8, start = 10;
+    } else if (major == 2 || major == 3) {
+        if (bytes.size() < 12) runtimeError("npy: truncated header");
+        length = 0, start = 12;
+        for (size_t i = 0; i < 4; i++)
+            length |= size_t(uint8_t(bytes[8 + i])) << (8 * i);
+    } else {
+        runtimeError("npy: unsupported format version {}", int(major));
+    }
+    if (bytes.size() < start + length) runtimeError("npy: truncated header");
+    std::string_view dict = bytes.substr(start, length);
+
+    // the text following `'key':`, with leading spaces skipped
+    auto value = [&](std::string_view key) {
+        size_t pos = dict.find(std::format("'{}'", key));
+        if (pos == dict.npos) runtimeError("npy: no '{}' in header {}", key, dict);
+        pos = dict.find(':', pos);
+        pos = dict.find_first_not_of(' ', pos + 1);
+        return dict.substr(pos);
+    };
+    Header header;
+    std::string_view descr = value("descr");
+    header.descr = descr.substr(1, descr.find(descr[0], 1) - 1);
+    header.fortran_order = value("fortran_order").starts_with("True");
+    std::string_view shape = value("shape");
+    shape = shape.substr(1, shape.find(')') - 1);
+    for (size_t pos = 0; (pos = shape.find_first_of("0123456789", pos)) != shape.npos;) {
+        size_t n = 0;
+        for (; pos < shape.size() && shape[pos] >= '0' && shape[pos] <= '9'; pos++) {
+            size_t digit = shape[pos] - '0';
+            if (n > (std::numeric_limits<size_t>::max() - digit) / 10)
+                runtimeError("npy: dimension out of range in header {}", dict);
+            n = n * 10 + digit;
+        }
+        header.shape.push_back(n);
+    }
+    header.data_offset = start + length;
+    return header;
+}
+
+// the header of a tensor of `shape`, padded so that the elements start on a multiple
+// of 64 bytes
+template <typename T> std::string make_header(const Shape& shape) {
+    std::string dims;
+    for (size_t n : shape) dims += std::format("{}, ", n);
+    if (shape.size() > 1) dims.resize(dims.size() - 2);
+    else if (shape.size() == 1) dims.pop_back();
+    std::string dict = std::format(
+        "{{'descr': '{}', 'fortran_order': False, 'shape': ({}), }}", descr<T>(), dims);
+    size_t length = (10 + dict.size() + 1 + 63) / 64 * 64 - 10;
+    dict.resize(length - 1, ' ');
+    dict += '\n';
+    std::string header(magic);
+    header += {'\x01', '\x00', char(length & 0xff), char(length >> 8)};
+    return header + dict;
+}
+
+// a read-only, private mapping of a whole file
+class Mapping {
+    void* _address{nullptr};
+    size_t _size{0};
+
+public:
+    explicit Mapping(const std::filesystem::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            runtimeError("npy: can not open {}: {}", path.string(), std::strerror(errno));
+        struct stat st;
+        int error = 0;
+        if (::fstat(fd, &st) == 0) _size = st.st_size;
+        if (_size > 0) {
+            _address = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (_address == MAP_FAILED) _address = nullptr, error = errno;
+        }
+        ::close(fd);
+        if (!_address)
+            runtimeError("npy: can not map {}: {}", path.string(),
+                         error ? std::strerror(error) : "empty file");
+    }
+    ~Mapping() { ::munmap(_address, _size); }
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    char* data() const { return static_cast<char*>(_address); }
+    size_t size() const { return _size; }
+};
+
+// The tensor stored at `path`, as a view into a mapping of the file. Elements that are
+// not aligned for `T`, which NumPy never writes, are copied instead.
+template <typename T> Tensor<T> load(const std::filesystem::path& path) {
+    auto mapping = std::make_shared<const Mapping>(path);
+    Header header = parse_header(std::string_view(mapping->data(), mapping->size()));
+    if (header.descr != descr<T>())
+        runtimeError("npy: {} holds '{}' elements, not '{}'", path.string(), header.descr,
+                     descr<T>());
+    if (header.shape.empty()) header.shape.push_back(1);  // a scalar
+    // checked against the elements in the file as it goes, so that it can not overflow
+    size_t size = 1, available = (mapping->size() - header.data_offset) / sizeof(T);
+    for (size_t n : header.shape) {
+        if (n != 0 && size > available / n)
+            runtimeError("npy: {} is truncated, or its shape {} out of range",
+                         path.string(), header.shape);
+        size *= n;
+    }
+
+    // a Fortran-ordered file holds the elements of the transpose in C order
+    Shape shape = header.shape, dims(shape.size());
+    for (size_t i = 0; i < shape.size(); i++) dims[i] = i;
+    if (header.fortran_order) {
+        std::reverse(shape.begin(), shape.end()), std::reverse(dims.begin(), dims.end());
+    }
+    char* elements = mapping->data() + header.data_offset;
+    Tensor<T> tensor;
+    if (reinterpret_cast<uintptr_t>(elements) % alignof(T) == 0) {
+        Shape strides(shape.size()), offsets(shape.size(), 0);
+        for (size_t i = shape.size(), stride = 1; i--;)
+            strides[i] = stride, stride *= shape[i];
+        Storage<T> storage(reinterpret_cast<T*>(elements), size, strides, offsets,
+                           mapping);
+        tensor = Tensor<T>(std::move(storage), shape);
+    } else {
+        tensor = Tensor<T>(shape);
+        std::memcpy(static_cast<void*>(tensor.data()), elements, size * sizeof(T));
+    }
+    if (header.fortran_order) return tensor.permute(dims);
+    return tensor;
+}
+
+// Write `tensor` to `path` in C order, replacing the file.
+template <typename T>
+void save(const std::filesystem::path& path, const Tensor<T>& tensor) {
+    if (tensor.empty()) runtimeError("npy: can not save an empty tensor");
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        runtimeError("npy: can not write {}: {}", path.string(), std::strerror(errno));
+    std::string header = make_header<T>(tensor.shape());
+    file.write(header.data(), header.size());
+    Tensor<T> elements = tensor.contiguous();
+    file.write(reinterpret_cast<const char*>(std::as_const(elements).data()),
+               elements.size() * sizeof(T));
+    if (!file) runtimeError("npy: failed writing {}", path.string());
+}
+
+}  // namespace npy
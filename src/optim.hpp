@@ -1,27 +1,225 @@
 #pragma once
+#include "allocator.hpp"
 #include "autodiff.hpp"
+#include "hessian.hpp"
+#include "parallel.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
 #include <initializer_list>
-#include <set>
+#include <limits>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#if defined(__AVX2__) && defined(__FMA__)
+#    include <immintrin.h>
+#endif
 
 namespace optim {
+// 64-byte aligned array, from the `BufferPool`
+template <typename T> using Buffer = std::vector<T, PoolAllocator<T>>;
+
+// Update rules over flat arrays of `n` parameters, their gradients and their state.
+//
+// Every element is updated independently. The AVX2 kernels are compiled in when the
+// target supports them (see gemm.hpp); the portable loops handle other types and the
+// tails. With the vector kernels in, the loops use `std::fma` where the vector code
+// fuses a multiply and an add, so that an element of a floating-point type rounds the
+// same whichever path handles it; without them, the loops keep plain arithmetic, which
+// the compiler can vectorize rather than call `fma` from libm.
+namespace kernel {
+#if defined(__AVX2__) && defined(__FMA__)
+inline constexpr bool fused = true;
+#else
+inline constexpr bool fused = false;
+#endif
+
+template <typename T> void sgd(size_t n, T* x, const T* g, T learning_rate) {
+    for (size_t i = 0; i < n; i++) x[i] -= learning_rate * g[i];
+}
+
+template <typename T> T dot(size_t n, const T* x, const T* y) {
+    T sum{};
+    for (size_t i = 0; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+// y += a * x
+template <typename T> void axpy(size_t n, T a, const T* x, T* y) {
+    for (size_t i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+// `rate` is the learning rate divided by the bias correction of `m`, `scale` the
+// inverse of the bias correction of `v`
+template <typename T> struct Adam {
+    T beta1, beta2, rate, scale, epsilon;
+
+    void element(T& x, const T& g, T& m, T& v) const {
+        using std::sqrt;
+        if constexpr (fused && std::is_floating_point_v<T>) {
+            m = std::fma(beta1, m, (1 - beta1) * g);
+            v = std::fma(beta2, v, (1 - beta2) * (g * g));
+        } else {
+            m = beta1 * m + (1 - beta1) * g;
+            v = beta2 * v + (1 - beta2) * (g * g);
+        }
+        x -= rate * m / (sqrt(v * scale) + epsilon);
+    }
+    void run(size_t n, T* x, const T* g, T* m, T* v) const {
+        for (size_t i = 0; i < n; i++) element(x[i], g[i], m[i], v[i]);
+    }
+};
+
+#if defined(__AVX2__) && defined(__FMA__)
+template <> inline void Adam<double>::run(size_t n, double* x, const double* g, double* m,
+                                          double* v) const {
+    __m256d b1 = _mm256_set1_pd(beta1), c1 = _mm256_set1_pd(1 - beta1);
+    __m256d b2 = _mm256_set1_pd(beta2), c2 = _mm256_set1_pd(1 - beta2);
+    __m256d r = _mm256_set1_pd(rate), s = _mm256_set1_pd(scale);
+    __m256d e = _mm256_set1_pd(epsilon);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d gi = _mm256_loadu_pd(g + i);
+        __m256d mi = _mm256_fmadd_pd(b1, _mm256_loadu_pd(m + i), _mm256_mul_pd(c1, gi));
+        __m256d vi = _mm256_fmadd_pd(b2, _mm256_loadu_pd(v + i),
+                                     _mm256_mul_pd(c2, _mm256_mul_pd(gi, gi)));
+        __m256d den = _mm256_add_pd(_mm256_sqrt_pd(_mm256_mul_pd(vi, s)), e);
+        __m256d step = _mm256_div_pd(_mm256_mul_pd(r, mi), den);
+        _mm256_storeu_pd(m + i, mi), _mm256_storeu_pd(v + i, vi);
+        _mm256_storeu_pd(x + i, _mm256_sub_pd(_mm256_loadu_pd(x + i), step));
+    }
+    for (; i < n; i++) element(x[i], g[i], m[i], v[i]);
+}
+
+template <> inline void Adam<float>::run(size_t n, float* x, const float* g, float* m,
+                                         float* v) const {
+    __m256 b1 = _mm256_set1_ps(beta1), c1 = _mm256_set1_ps(1 - beta1);
+    __m256 b2 = _mm256_set1_ps(beta2), c2 = _mm256_set1_ps(1 - beta2);
+    __m256 r = _mm256_set1_ps(rate), s = _mm256_set1_ps(scale);
+    __m256 e = _mm256_set1_ps(epsilon);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 gi = _mm256_loadu_ps(g + i);
+        __m256 mi = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i), _mm256_mul_ps(c1, gi));
+        __m256 vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i),
+                                    _mm256_mul_ps(c2, _mm256_mul_ps(gi, gi)));
+        __m256 den = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vi, s)), e);
+        __m256 step = _mm256_div_ps(_mm256_mul_ps(r, mi), den);
+        _mm256_storeu_ps(m + i, mi), _mm256_storeu_ps(v + i, vi);
+        _mm256_storeu_ps(x + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), step));
+    }
+    for (; i < n; i++) element(x[i], g[i], m[i], v[i]);
+}
+#endif
+}  // namespace kernel
+
+// Registry of parameters, owning one contiguous buffer with the gradients of them all.
+//
+// The leaf of parameter i accumulates its gradient into `grads()[i]` instead of its node
+// (see `TapeNode::gradient`), so reading the gradients is a linear scan and `zero_grad`
+// a single memset. Parameters are leaves, and a node belongs to at most one registry.
+// The parameters must outlive the registry and keep their node while registered; when
+// it is destroyed, their gradients move back to their nodes.
+template <typename T> class Parameters {
+    std::vector<AutoDiff<T>*> params;  // distinct, in the order given
+    Buffer<T> _grads;
+
+public:
+    Parameters(std::vector<AutoDiff<T>*> parameters) {
+        std::unordered_set<AutoDiff<T>*> seen;
+        for (auto v : parameters) {
+            if (seen.insert(v).second) params.push_back(v);
+        }
+        _grads.resize(params.size());
+        for (size_t i = 0; i < params.size(); i++) {
+            auto node = params[i]->node;
+            if (node == nullptr) runtimeError("parameter {} has no graph node", i);
+            // interior nodes pass their adjoint on from `_diff`, see `TapeNode::backward`
+            if (node->op != nullptr) runtimeError("parameter {} is not a leaf", i);
+            if (node->_grad != nullptr)
+                runtimeError("parameter {} is registered twice", i);
+            _grads[i] = std::exchange(node->_diff, T{});
+            node->_grad = &_grads[i];
+        }
+    }
+    ~Parameters() {
+        for (size_t i = 0; i < params.size(); i++) {
+            auto node = params[i]->node;
+            if (node == nullptr || node->_grad != &_grads[i]) continue;
+            node->_diff = _grads[i];
+            node->_grad = nullptr;
+        }
+    }
+    Parameters(const Parameters&) = delete;
+    Parameters& operator=(const Parameters&) = delete;
+
+    size_t size() const { return params.size(); }
+    AutoDiff<T>* operator[](size_t i) const { return params[i]; }
+    T* grads() { return _grads.data(); }
+    const T* grads() const { return _grads.data(); }
+
+    // clear the gradients of parameters [begin, end)
+    void zero_grad(size_t begin, size_t end) {
+        if constexpr (std::is_trivially_copyable_v<T>)
+            std::memset(static_cast<void*>(grads() + begin), 0,
+                        (end - begin) * sizeof(T));
+        else
+            std::fill(_grads.begin() + begin, _grads.begin() + end, T{});
+    }
+    void zero_grad() { zero_grad(0, size()); }
+};
+
+// Parameters, with their values packed into a flat array next to their gradients.
+//
+// A step goes through the parameters in chunks of `chunk` elements, sized so that the
+// arrays of a chunk stay in L2: it `gather`s the values of the chunk, runs its update
+// over the arrays, `scatter`s the values back and clears the gradients. Chunks are
+// independent and run on a thread pool, the shared one unless `run_on` says otherwise;
+// as every element is updated the same way whichever thread runs its chunk, the result
+// is the same bit for bit as on a single thread. Every parameter must have a node (not
+// be created under `no_grad`), see `Parameters`.
 template <typename T> class Optimizer {
+public:
+    static constexpr size_t chunk = 4096;  // a multiple of the SIMD width
+
 protected:
-    std::set<AutoDiff<T>*> params;
+    Parameters<T> params;
+    Buffer<T> values;
+    ThreadPool* pool{&ThreadPool::shared()};
 
-private:
-    void traverse(AutoDiff<T>* v) {
-        if (params.count(v)) return;
-        params.insert(v);
+    T* grads() { return params.grads(); }
+    void gather(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) values[i] = params[i]->raw();
+    }
+    void scatter(size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) params[i]->raw() = values[i];
+        params.zero_grad(begin, end);
     }
-    void traverse(auto container) {
-        for (auto& v : container) {
-            traverse(v);
+
+    // `f(begin, end)` for every chunk [begin, end) of the parameters
+    template <typename F> void for_chunks(F&& f) {
+        size_t n = params.size(), chunks = (n + chunk - 1) / chunk;
+        auto task = [&](size_t c) { f(c * chunk, std::min(n, (c + 1) * chunk)); };
+        if (pool == nullptr || chunks <= 1) {
+            for (size_t c = 0; c < chunks; c++) task(c);
+        } else {
+            pool->run(chunks, task);
         }
     }
 
 public:
-    Optimizer(std::vector<AutoDiff<T>*> parameters) { traverse(parameters); }
+    Optimizer(std::vector<AutoDiff<T>*> parameters) : params(std::move(parameters)) {
+        values.resize(params.size());
+    }
+    size_t size() const { return params.size(); }
+    Parameters<T>& parameters() { return params; }
+    void zero_grad() { params.zero_grad(); }
+    // run the steps on `pool`, or on the calling thread if it is null
+    void run_on(ThreadPool* pool) { this->pool = pool; }
 };
 
 template <typename T> class GradientDescent : public Optimizer<T> {
@@ -31,10 +229,12 @@ public:
     GradientDescent(std::vector<AutoDiff<T>*> parameters, T learning_rate)
         : Optimizer<T>(parameters), learning_rate(learning_rate) {}
     void step() {
-        for (auto& v : this->params) {
-            v->raw() -= learning_rate * v->diff();
-            v->clear();
-        }
+        this->for_chunks([&](size_t begin, size_t end) {
+            this->gather(begin, end);
+            kernel::sgd(end - begin, this->values.data() + begin,
+                        this->grads() + begin, learning_rate);
+            this->scatter(begin, end);
+        });
     }
 };
 template <typename T>
@@ -42,38 +242,318 @@ GradientDescent(std::vector<AutoDiff<T>*> parameters, ...)
     -> GradientDescent<T>;
 
 template <typename T> class Adam : public Optimizer<T> {
-    struct AdamVariable {
-        T m{0}, v{0};
-    };
-    std::map<AutoDiff<T>*, AdamVariable> adam_params;
+    Buffer<T> m, v;  // first and second moments
     T learning_rate, beta1, beta2, epsilon;
-    int t{0};
+    T beta1_t{1}, beta2_t{1};  // `beta1^t` and `beta2^t`, at step t
 
 public:
     Adam(std::vector<AutoDiff<T>*> parameters, T learning_rate, T beta1 = 0.9,
          T beta2 = 0.999, T epsilon = 1e-8)
         : Optimizer<T>(parameters), learning_rate(learning_rate), beta1(beta1),
           beta2(beta2), epsilon(epsilon) {
-        for (auto& v : this->params) {
-            adam_params[v];
-        }
+        m.resize(this->size()), v.resize(this->size());
     }
     void step() {
-        t++;
-        for (auto& [v, adam_v] : adam_params) {
-            auto& x = v->raw();
-            auto g = v->diff();
-            adam_v.m = beta1 * adam_v.m + (1 - beta1) * g;
-            adam_v.v = beta2 * adam_v.v + (1 - beta2) * g * g;
-            auto m_hat = adam_v.m / (1 - pow(beta1, t));
-            auto v_hat = adam_v.v / (1 - pow(beta2, t));
-            x -= learning_rate * m_hat / (sqrt(v_hat) + epsilon);
-            v->clear();
-        }
+        beta1_t *= beta1, beta2_t *= beta2;
+        kernel::Adam<T> update{beta1, beta2, learning_rate / (1 - beta1_t),
+                               1 / (1 - beta2_t), epsilon};
+        this->for_chunks([&](size_t begin, size_t end) {
+            this->gather(begin, end);
+            update.run(end - begin, this->values.data() + begin,
+                       this->grads() + begin, m.data() + begin, v.data() + begin);
+            this->scatter(begin, end);
+        });
     }
 };
 
 template <typename T>
 Adam(std::initializer_list<AutoDiff<T>*> parameters, ...) -> Adam<T>;
 
-}  // namespace optim
\ No newline at end of file
+// Limited-memory BFGS, for smooth deterministic losses.
+//
+// `step(loss)` runs one iteration: `loss()` builds the graph of the loss at the current
+// parameters and returns it, and is called again at every trial point of the line
+// search, which finds a step length satisfying the strong Wolfe conditions. The inverse
+// Hessian is approximated from the last `history` pairs of steps s = x' - x and
+// gradient changes y = g' - g, kept in preallocated ring buffers and applied to the
+// gradient in place by the two-loop recursion; a pair without positive curvature is
+// dropped, and a direction along which the line search finds no decrease is replaced by
+// -g. `step` returns the loss at the new parameters; once the largest gradient
+// component falls under `tolerance`, it leaves them unchanged. The loss and gradient at
+// the point where a step ends are kept for the next one, so an iteration only costs the
+// evaluations of its line search; call `reset()` after changing the parameters or the
+// loss between steps.
+template <typename T> class LBFGS : public Optimizer<T> {
+    static_assert(std::is_floating_point_v<T>);
+    static constexpr T c1 = 1e-4, c2 = 0.9;  // sufficient decrease and curvature
+
+    size_t history;
+    T learning_rate, tolerance;
+    size_t max_evals;  // loss evaluations per line search
+    Buffer<T> s, y;    // [history][parameter], pair k in row (head + k) % history
+    std::vector<T> rho, alpha;
+    size_t head{0}, stored{0};
+    Buffer<T> x, g, d, trial_g;  // parameters, gradient, direction, gradient at a trial
+    Buffer<T> lo_g;              // gradient at the low end of the bracket, then y
+    T f{};                       // loss at x
+    bool evaluated{false};       // whether f and g are those at x
+
+    T* row(Buffer<T>& buffer, size_t k) { return buffer.data() + k * this->size(); }
+    // the k-th most recent pair
+    size_t slot(size_t k) const { return (head + history - 1 - k) % history; }
+    // d = -g, forgetting the curvature pairs; returns the slope along d
+    T steepest_descent(size_t n) {
+        head = stored = 0;
+        for (size_t i = 0; i < n; i++) d[i] = -g[i];
+        return -kernel::dot(n, g.data(), g.data());
+    }
+
+    // move the parameters to `x + t * d`
+    void move_to(T t) {
+        size_t n = this->size();
+        std::copy_n(x.data(), n, this->values.data());
+        kernel::axpy(n, t, d.data(), this->values.data());
+        this->for_chunks([&](size_t begin, size_t end) { this->scatter(begin, end); });
+    }
+
+    // the loss and the directional derivative along `d` at `x + t * d`, with the
+    // gradient in `trial_g`
+    template <typename F> std::pair<T, T> evaluate(F& loss, T t) {
+        size_t n = this->size();
+        move_to(t);
+        auto l = loss();
+        l.propagate();
+        std::copy_n(this->grads(), n, trial_g.data());
+        return {l.raw(), kernel::dot(n, trial_g.data(), d.data())};
+    }
+
+    // minimizer of the cubic through (t1, f1, g1) and (t2, f2, g2), kept within the
+    // middle of the interval, bisection where there is none
+    static T cubic(T t1, T f1, T g1, T t2, T f2, T g2) {
+        T lo = std::min(t1, t2), hi = std::max(t1, t2), margin = (hi - lo) / 10;
+        T d1 = g1 + g2 - 3 * (f1 - f2) / (t1 - t2), d2 = d1 * d1 - g1 * g2;
+        if (d2 >= 0) {
+            d2 = std::sqrt(d2);
+            T t = t2 - (t2 - t1) * (g2 + d2 - d1) / (g2 - g1 + 2 * d2);
+            if (t >= lo + margin && t <= hi - margin) return t;
+        }
+        return (lo + hi) / 2;
+    }
+
+    // Step length along `d` from loss `f0` and slope `g0` (Nocedal and Wright, algorithms
+    // 3.5 and 3.6): bracket an interval containing acceptable lengths, then shrink it.
+    // Returns the length and the loss there, with the parameters moved there and their
+    // gradient in `trial_g`, after at most `max_evals` evaluations of the loss.
+    template <typename F> std::pair<T, T> line_search(F& loss, T f0, T g0, T t) {
+        struct Point {
+            T t, f, g;
+        };
+        // the gradient at `prev`, then at `lo`, is kept in `lo_g`
+        Point prev{0, f0, g0}, lo, hi;
+        std::copy_n(g.data(), this->size(), lo_g.data());
+        size_t evals = 0;
+        bool bracketed = false;
+        while (evals < max_evals) {
+            auto [f, g] = evaluate(loss, t);
+            evals++;
+            Point cur{t, f, g};
+            if (f > f0 + c1 * t * g0 || (evals > 1 && f >= prev.f)) {
+                lo = prev, hi = cur, bracketed = true;
+                break;
+            }
+            if (std::abs(g) <= -c2 * g0) return {t, f};
+            trial_g.swap(lo_g);
+            if (g >= 0) {
+                lo = cur, hi = prev, bracketed = true;
+                break;
+            }
+            prev = cur, t *= 2;
+        }
+        if (!bracketed) lo = prev;  // out of evaluations
+        while (bracketed && evals < max_evals &&
+               std::abs(hi.t - lo.t) > 1e-9 * std::abs(lo.t)) {
+            t = cubic(lo.t, lo.f, lo.g, hi.t, hi.f, hi.g);
+            auto [f, g] = evaluate(loss, t);
+            evals++;
+            if (f > f0 + c1 * t * g0 || f >= lo.f) {
+                hi = {t, f, g};
+                continue;
+            }
+            if (std::abs(g) <= -c2 * g0) return {t, f};
+            if (g * (hi.t - lo.t) >= 0) hi = lo;
+            lo = {t, f, g};
+            trial_g.swap(lo_g);
+        }
+        // the best length found, which satisfies sufficient decrease
+        trial_g.swap(lo_g);
+        move_to(lo.t);
+        return {lo.t, lo.f};
+    }
+
+public:
+    LBFGS(std::vector<AutoDiff<T>*> parameters, size_t history = 10, T learning_rate = 1,
+          T tolerance = 1e-7, size_t max_evals = 25)
+        : Optimizer<T>(parameters), history(std::max<size_t>(history, 1)),
+          learning_rate(learning_rate), tolerance(tolerance), max_evals(max_evals) {
+        size_t n = this->size();
+        s.resize(this->history * n), y.resize(this->history * n);
+        rho.resize(this->history), alpha.resize(this->history);
+        x.resize(n), g.resize(n), d.resize(n), trial_g.resize(n), lo_g.resize(n);
+    }
+
+    // forget the curvature pairs, and the loss and gradient kept from the last step
+    void reset() { head = stored = 0, evaluated = false; }
+
+    template <typename F> T step(F&& loss) {
+        size_t n = this->size();
+        if (!evaluated) {
+            this->zero_grad();
+            auto l = loss();
+            l.propagate();
+            f = l.raw();
+            std::copy_n(this->grads(), n, g.data());
+            this->for_chunks([&](size_t begin, size_t end) { this->gather(begin, end); });
+            std::copy_n(this->values.data(), n, x.data());
+            this->zero_grad();
+            evaluated = true;
+        }
+        T largest = 0;
+        for (size_t i = 0; i < n; i++) largest = std::max(largest, std::abs(g[i]));
+        if (largest <= tolerance) return f;
+
+        // d = -H g, by the two-loop recursion
+        std::copy_n(g.data(), n, d.data());
+        for (size_t k = 0; k < stored; k++) {
+            size_t i = slot(k);
+            alpha[i] = rho[i] * kernel::dot(n, row(s, i), d.data());
+            kernel::axpy(n, -alpha[i], row(y, i), d.data());
+        }
+        if (stored > 0) {
+            T* y0 = row(y, slot(0));
+            T gamma = 1 / (rho[slot(0)] * kernel::dot(n, y0, y0));
+            for (size_t i = 0; i < n; i++) d[i] *= gamma;
+        }
+        for (size_t k = stored; k--;) {
+            size_t i = slot(k);
+            T beta = rho[i] * kernel::dot(n, row(y, i), d.data());
+            kernel::axpy(n, alpha[i] - beta, row(s, i), d.data());
+        }
+        for (size_t i = 0; i < n; i++) d[i] = -d[i];
+        T slope = kernel::dot(n, g.data(), d.data());
+        // not a descent direction: restart from the gradient
+        if (!(slope < 0)) slope = steepest_descent(n);
+        // without curvature information, the first step moves by at most the learning
+        // rate along each coordinate
+        auto initial = [&] {
+            if (stored > 0) return learning_rate;
+            T norm = 0;
+            for (size_t i = 0; i < n; i++) norm += std::abs(g[i]);
+            return learning_rate * std::min<T>(1, 1 / norm);
+        };
+
+        auto [length, trial_f] = line_search(loss, f, slope, initial());
+        if (length == 0 && stored > 0) {
+            // no decrease found along the quasi-Newton direction, which the next step
+            // would take again: retry along the gradient
+            slope = steepest_descent(n);
+            std::tie(length, trial_f) = line_search(loss, f, slope, initial());
+        }
+        this->zero_grad();
+        // s = length * d and y = g' - g, computed in place and kept only if the pair
+        // has positive curvature, so a rejected pair never overwrites the oldest one;
+        // the new point, loss and gradient become those of the next step
+        for (size_t i = 0; i < n; i++) d[i] *= length, lo_g[i] = trial_g[i] - g[i];
+        std::copy_n(this->values.data(), n, x.data());
+        g.swap(trial_g), f = trial_f;
+        T sy = kernel::dot(n, d.data(), lo_g.data());
+        if (sy > std::numeric_limits<T>::epsilon() *
+                     kernel::dot(n, lo_g.data(), lo_g.data())) {
+            std::copy_n(d.data(), n, row(s, head));
+            std::copy_n(lo_g.data(), n, row(y, head));
+            rho[head] = 1 / sy;
+            head = (head + 1) % history, stored = std::min(stored + 1, history);
+        }
+        return f;
+    }
+};
+
+// Truncated Newton: steps along an approximate solution of H p = -g, found by conjugate
+// gradients from Hessian-vector products (see hessian.hpp), so the Hessian is never
+// formed.
+//
+// Unlike the optimizers above, it does not update registered parameters: the Hessian-
+// vector products rerun the loss on `Variable<Dual<T>>` inputs, which the `Variable<T>`
+// weights of a model cannot be. It solves over a plain array of values instead, so the
+// loss must be written as a function of them. `step(loss, x)` runs one iteration and
+// updates `x` in place. `loss(x)` computes the loss from the values `x`, a
+// `std::vector<Variable<U>>`, and is called with U = T for gradients and values and
+// U = Dual<T> for Hessian-vector products, so it is a generic lambda. CG stops once the
+// residual is below min(0.5, sqrt(|g|)) |g|, after `max_cg` products, or on a direction
+// of negative curvature, where it falls back to the last iterate (or to -g on the
+// first). A backtracking line search from the full Newton step then ensures sufficient
+// decrease. `step` returns the loss at the new values; once the largest gradient
+// component falls under `tolerance`, it leaves them unchanged.
+template <typename T> class NewtonCG {
+    static_assert(std::is_floating_point_v<T>);
+    static constexpr T c1 = 1e-4;  // sufficient decrease
+
+    size_t n, max_cg;
+    T tolerance;
+    size_t max_evals;  // loss evaluations per line search
+    Buffer<T> x0, g, p, r, d, hd, scratch;  // scratch takes the gradients of `hvp`
+
+public:
+    NewtonCG(size_t size, size_t max_cg = 50, T tolerance = 1e-7, size_t max_evals = 25)
+        : n(size), max_cg(max_cg), tolerance(tolerance), max_evals(max_evals) {
+        for (auto buffer : {&x0, &g, &p, &r, &d, &hd, &scratch}) buffer->resize(n);
+    }
+    size_t size() const { return n; }
+
+    template <typename F> T step(F&& loss, std::span<T> x) {
+        if (x.size() != n) runtimeError("{} values for a solver of size {}", x.size(), n);
+        std::copy_n(x.data(), n, x0.data());
+        T f = hessian::gradient<T>(loss, x0, g);
+        T largest = 0;
+        for (size_t i = 0; i < n; i++) largest = std::max(largest, std::abs(g[i]));
+        if (largest <= tolerance) return f;
+
+        // solve H p = -g: r is the residual H p + g, d the search direction
+        T gg = kernel::dot(n, g.data(), g.data());
+        T bound = std::min<T>(0.5, std::sqrt(std::sqrt(gg))) * std::sqrt(gg);
+        std::fill(p.begin(), p.end(), T{});
+        std::copy_n(g.data(), n, r.data());
+        for (size_t i = 0; i < n; i++) d[i] = -g[i];
+        T rr = gg;
+        for (size_t k = 0; k < max_cg; k++) {
+            hessian::hvp<T>(loss, x0, d, scratch, hd);
+            T curvature = kernel::dot(n, d.data(), hd.data());
+            if (curvature <= 0) {
+                if (k == 0) std::copy_n(d.data(), n, p.data());
+                break;
+            }
+            T alpha = rr / curvature;
+            kernel::axpy(n, alpha, d.data(), p.data());
+            kernel::axpy(n, alpha, hd.data(), r.data());
+            T rr_next = kernel::dot(n, r.data(), r.data());
+            if (std::sqrt(rr_next) <= bound) break;
+            T beta = rr_next / rr;
+            for (size_t i = 0; i < n; i++) d[i] = beta * d[i] - r[i];
+            rr = rr_next;
+        }
+
+        // backtrack from the Newton step until the loss decreases enough
+        T slope = kernel::dot(n, g.data(), p.data()), t = 1;
+        bool accepted = false;
+        for (size_t e = 0; e < max_evals && !accepted; e++, t /= 2) {
+            std::copy_n(x0.data(), n, x.data());
+            kernel::axpy(n, t, p.data(), x.data());
+            T trial_f = hessian::value<T>(loss, std::span<const T>(x));
+            if (trial_f <= f + c1 * t * slope) f = trial_f, accepted = true;
+        }
+        // without enough decrease along p, the values stay where they were
+        if (!accepted) std::copy_n(x0.data(), n, x.data());
+        return f;
+    }
+};
+
+}  // namespace optim
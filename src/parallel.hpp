@@ -0,0 +1,205 @@
+#pragma once
+#include "autodiff.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of worker threads that run batches of indexed tasks.
+//
+// `run(n, task)` calls `task(i)` for every i in [0, n), on the workers and on the calling
+// thread, and returns once all of them have finished; the first exception thrown by a
+// task is rethrown. Which thread runs which index is unspecified, so a task must only
+// depend on its index. Called from inside a task, or on a pool without workers, `run`
+// calls the tasks in order on the calling thread.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex running;  // one batch at a time
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)>* task{nullptr};
+    size_t count{0}, next{0}, finished{0};
+    unsigned generation{0};
+    bool stopping{false};
+    std::exception_ptr error;
+    static inline thread_local bool in_task = false;
+
+    // take indices of the current batch until there is none left, `lock` is held
+    void drain(std::unique_lock<std::mutex>& lock) {
+        while (next < count) {
+            size_t i = next++;
+            const auto& f = *task;
+            lock.unlock();
+            std::exception_ptr thrown;
+            in_task = true;
+            try {
+                f(i);
+            } catch (...) {
+                thrown = std::current_exception();
+            }
+            in_task = false;
+            lock.lock();
+            if (thrown && !error) error = thrown;
+            if (++finished == count) done.notify_all();
+        }
+    }
+
+    void work() {
+        std::unique_lock lock(mutex);
+        unsigned seen = generation;
+        while (true) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            drain(lock);
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back(&ThreadPool::work, this);
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // pool with one thread per core, created on first use
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // number of threads running tasks, the caller included
+    size_t size() const { return workers.size() + 1; }
+
+    void run(size_t n, const std::function<void(size_t)>& f) {
+        if (n == 0) return;
+        if (in_task || workers.empty()) {
+            for (size_t i = 0; i < n; i++) f(i);
+            return;
+        }
+        std::lock_guard batch(running);
+        std::unique_lock lock(mutex);
+        task = &f, count = n, next = 0, finished = 0;
+        generation++;
+        wake.notify_all();
+        drain(lock);
+        done.wait(lock, [&] { return finished == count; });
+        task = nullptr, count = 0;
+        if (error) std::rethrow_exception(std::exchange(error, nullptr));
+    }
+};
+
+// Data-parallel gradients of a loss summed over samples.
+//
+// `backward(samples, loss)` splits the samples into `shards` contiguous ranges and runs
+// them on a thread pool. Each shard builds and propagates the graph of every sample on
+// the thread-local tape of whichever thread runs it, while the gradients that reach the
+// registered parameters are accumulated into a buffer owned by the shard (see
+// `TapeNode::sink`), so workers never write to shared nodes. The buffers are then added
+// to the parameters in shard order: for a given number of shards the result is the same
+// from run to run, whatever the number of threads and the scheduling. The number of
+// shards defaults to `default_shards` rather than to the size of the pool, so that the
+// gradients are also the same on machines with different numbers of cores; it is large
+// enough to keep every core of a big machine busy, at the cost of one gradient buffer
+// per shard and of summing them all. Pass a smaller count for large models on few
+// cores. Call the optimizer's `step()` afterwards as usual.
+//
+// `loss(i)` is called concurrently and must only read the parameters. Every parameter
+// must have a node (not be created under `no_grad`). Any other `Variable` that `loss`
+// reads from several shards must be registered too, with `require_diff(false)`: the
+// reference counts of unregistered nodes are not atomic, and a variable created under
+// `no_grad` gets its node on first use. Per-sample data is best created inside `loss`.
+template <typename T> class DataParallel {
+    std::vector<AutoDiff<T>*> params;
+    ThreadPool& pool;
+    size_t shards;
+    std::vector<std::vector<T>> grads;  // [shard][parameter]
+
+    // release the slots of the first `count` parameters
+    void unregister(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (params[i]->node) params[i]->node->_slot = -1;
+        }
+    }
+
+    // bind the gradient buffer of a shard to the current thread
+    class Sink {
+        T* prev;
+
+    public:
+        Sink(std::vector<T>& grad) : prev(TapeNode<T>::sink) {
+            TapeNode<T>::sink = grad.data();
+        }
+        ~Sink() { TapeNode<T>::sink = prev; }
+    };
+
+public:
+    static constexpr size_t default_shards = 64;
+
+    DataParallel(std::vector<AutoDiff<T>*> parameters,
+                 ThreadPool& pool = ThreadPool::shared())
+        : DataParallel(std::move(parameters), default_shards, pool) {}
+    DataParallel(std::vector<AutoDiff<T>*> parameters, size_t shards,
+                 ThreadPool& pool = ThreadPool::shared())
+        : params(std::move(parameters)), pool(pool), shards(std::max<size_t>(shards, 1)) {
+        for (size_t i = 0; i < params.size(); i++) {
+            auto node = params[i]->node;
+            // the parameters before this one are left unregistered on error
+            if (node == nullptr) {
+                unregister(i);
+                runtimeError("parameter {} has no graph node", i);
+            }
+            if (node->_slot >= 0) {
+                unregister(i);
+                runtimeError("parameter {} is registered twice", i);
+            }
+            node->_slot = i;
+        }
+    }
+    ~DataParallel() { unregister(params.size()); }
+    DataParallel(const DataParallel&) = delete;
+    DataParallel& operator=(const DataParallel&) = delete;
+
+    // add the gradient of `loss(0) + ... + loss(samples - 1)` to the parameters, and
+    // return that sum
+    template <typename F> T backward(size_t samples, F&& loss) {
+        size_t n = std::min(shards, samples);
+        grads.resize(n);
+        for (auto& grad : grads) grad.assign(params.size(), T{});
+        std::vector<T> losses(n, T{});
+        pool.run(n, [&](size_t shard) {
+            Sink sink(grads[shard]);
+            size_t begin = samples * shard / n, end = samples * (shard + 1) / n;
+            for (size_t s = begin; s < end; s++) {
+                typename TapeArena<T>::Scope arena;
+                auto l = loss(s);
+                l.propagate();
+                losses[shard] += l.raw();
+            }
+        });
+        T total{};
+        for (size_t shard = 0; shard < n; shard++) {
+            for (size_t i = 0; i < params.size(); i++) {
+                auto node = params[i]->node;
+                Operation<T>::accumulate(node->gradient(), grads[shard][i], node->_value);
+            }
+            total += losses[shard];
+        }
+        return total;
+    }
+};
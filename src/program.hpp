@@ -0,0 +1,121 @@
+#pragma once
+#include "autodiff.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// A recorded computation that can be replayed without building a graph.
+//
+// `Program(output)` walks the graph that computes `output` once and flattens it into a
+// list of instructions (operation and operand indices) in topological order. The leaves
+// of the graph are kept alive and act as inputs: assign new values to them through their
+// `Variable`s, then `forward()` re-evaluates every instruction and `backward()`
+// accumulates gradients into the leaves exactly like `propagate()` would, without
+// allocating a single node. The control flow of the recorded function is fixed at
+// capture time.
+template <typename T> class Program {
+    using Node = TapeNode<T>;
+    struct Instruction {
+        const Operation<T>* op;
+        uint32_t lhs, rhs;
+        bool require_diff;
+    };
+
+    // slots [0, leaves.size()) hold the leaves, the rest one instruction each
+    std::vector<Node*> leaves;
+    std::vector<Instruction> code;
+    std::vector<T> values, diffs;
+
+    void release() {
+        for (auto leaf : leaves) {
+            leaf->remove_ref();
+            if (!leaf->ref_count()) delete leaf;
+        }
+        leaves.clear();
+        for (const auto& ins : code) Operation<T>::drop(ins.op);
+        code.clear();
+    }
+
+public:
+    explicit Program(const AutoDiff<T>& output) {
+        if (output.node == nullptr) runtimeError("record a variable without graph");
+        // post-order DFS, so operands come before the instructions that use them
+        std::vector<Node*> order;
+        std::unordered_map<const Node*, uint32_t> slot;
+        std::vector<std::pair<Node*, bool>> stack{{output.node, false}};
+        while (stack.size()) {
+            auto [cur, expanded] = stack.back();
+            stack.pop_back();
+            if (slot.count(cur)) continue;
+            if (cur->op != nullptr && !expanded) {
+                stack.emplace_back(cur, true);
+                if (cur->rhs) stack.emplace_back(cur->rhs, false);
+                stack.emplace_back(cur->lhs, false);
+                continue;
+            }
+            slot[cur] = 0;
+            if (cur->op == nullptr)
+                leaves.push_back(cur), cur->add_ref();
+            else
+                order.push_back(cur);
+        }
+        for (uint32_t i = 0; i < leaves.size(); i++) slot[leaves[i]] = i;
+        for (uint32_t i = 0; i < order.size(); i++) slot[order[i]] = leaves.size() + i;
+        code.reserve(order.size());
+        for (auto cur : order) {
+            uint32_t lhs = slot[cur->lhs];
+            uint32_t rhs = cur->rhs ? slot[cur->rhs] : lhs;
+            auto op = Operation<T>::acquire(cur->op);
+            code.push_back({op, lhs, rhs, cur->_require_diff});
+        }
+        values.resize(leaves.size() + code.size());
+        diffs.resize(values.size());
+        forward();
+    }
+    ~Program() { release(); }
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+    Program(Program&& other) noexcept = default;
+    Program& operator=(Program&& other) noexcept {
+        if (this == &other) return *this;
+        release();
+        leaves = std::move(other.leaves);
+        code = std::move(other.code);
+        values = std::move(other.values);
+        diffs = std::move(other.diffs);
+        return *this;
+    }
+
+    size_t size() const { return code.size(); }
+    const T& value() const { return values.back(); }
+
+    // re-evaluate with the current values of the leaves
+    const T& forward() {
+        size_t n = leaves.size();
+        for (size_t i = 0; i < n; i++) values[i] = leaves[i]->_value;
+        for (size_t i = 0; i < code.size(); i++) {
+            const auto& ins = code[i];
+            values[n + i] = ins.op->forward(*ins.op, values[ins.lhs], values[ins.rhs]);
+        }
+        return values.back();
+    }
+
+    // reverse sweep over the instructions, then accumulate into the leaves
+    void backward(T initial_diff = 1) {
+        size_t n = leaves.size();
+        std::fill(diffs.begin(), diffs.end(), T{});
+        Operation<T>::accumulate(diffs.back(), initial_diff, values.back());
+        for (size_t i = code.size(); i--;) {
+            const auto& ins = code[i];
+            if (!ins.require_diff) continue;
+            auto [dl, dr] = ins.op->adjoint(*ins.op, diffs[n + i], values[ins.lhs],
+                                            values[ins.rhs], values[n + i]);
+            Operation<T>::accumulate(diffs[ins.lhs], dl, values[ins.lhs]);
+            Operation<T>::accumulate(diffs[ins.rhs], dr, values[ins.rhs]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (leaves[i]->_require_diff) leaves[i]->accumulate(diffs[i]);
+        }
+    }
+};
@@ -1,49 +1,217 @@
+#pragma once
+#include "allocator.hpp"
+#include "gemm.hpp"
+#include "parallel.hpp"
 #include "util.hpp"
+#include "variable.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <functional>
 #include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Vector with a fixed capacity, stored inline. Shapes, strides and indices are
+// SmallVectors, so building, copying or stepping through them never touches the heap.
+template <typename T, size_t Capacity> class SmallVector {
+    std::array<T, Capacity> _data{};
+    size_t _size{0};
+
+public:
+    SmallVector() = default;
+    explicit SmallVector(size_t size, T value = T()) { resize(size, value); }
+    SmallVector(std::initializer_list<T> values)
+        : SmallVector(values.begin(), values.end()) {}
+    template <std::input_iterator It> SmallVector(It first, It last) {
+        for (; first != last; ++first) push_back(*first);
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    auto& operator[](this auto& self, size_t i) { return self._data[i]; }
+    auto& back(this auto& self) { return self._data[self._size - 1]; }
+    auto* data(this auto& self) { return self._data.data(); }
+    auto* begin(this auto& self) { return self._data.data(); }
+    auto* end(this auto& self) { return self._data.data() + self._size; }
+
+    void push_back(T value) {
+        if (_size == Capacity) runtimeError("exceed the capacity of {}", Capacity);
+        _data[_size++] = value;
+    }
+    void pop_back() { _size--; }
+    void resize(size_t size, T value = T()) {
+        if (size > Capacity) runtimeError("exceed the capacity of {}", Capacity);
+        for (size_t i = _size; i < size; i++) _data[i] = value;
+        _size = size;
+    }
+    void clear() { _size = 0; }
+
+    bool operator==(const SmallVector& other) const {
+        return std::equal(begin(), end(), other.begin(), other.end());
+    }
+
+    std::string toString() const { return "[" + ::toString(begin(), end()) + "]"; }
+};
+
+inline constexpr size_t max_rank = 8;
+using Shape = SmallVector<size_t, max_rank>;
+
+// Elements of a tensor, in a reference-counted buffer.
+//
+// Every owner of elements has a slot that points to its buffer, and the views taken from
+// it look into the same slot. Owners have value semantics: copies get a slot of their
+// own to the same buffer, and share it until one of them is about to be written, which
+// then `detach`es, pointing its slot to a copy of the buffer. Its views follow the slot,
+// so that taking a view never copies anything, and writing through a view detaches the
+// slot as its owner would. A view can also look into external memory, which is not
+// counted.
+//
+// Buffers, elements and bookkeeping alike, come from the `BufferPool`, so the elements
+// are 64-byte aligned and recycled once the last tensor using them is gone. A buffer
+// of external memory may instead hold a `source` that keeps the memory alive (a mapped
+// file, see npy.hpp); it is counted like any buffer but never owned nor written.
 template <typename T> class Storage {
+    struct Buffer {
+        T* elements;
+        size_t size;
+        // keeps external elements alive, null for elements from the pool
+        std::shared_ptr<const void> source;
+        explicit Buffer(size_t size) : size(size) {
+            elements = static_cast<T*>(BufferPool::shared().allocate(size * sizeof(T)));
+            std::uninitialized_value_construct_n(elements, size);
+        }
+        Buffer(T* elements, size_t size, std::shared_ptr<const void> source)
+            : elements(elements), size(size), source(std::move(source)) {}
+        ~Buffer() {
+            if (source) return;
+            std::destroy_n(elements, size);
+            BufferPool::shared().deallocate(elements, size * sizeof(T));
+        }
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+    };
+    // the buffer of an owner and of its views; one reference to the buffer per owner
+    struct Slot {
+        std::shared_ptr<Buffer> buffer;
+    };
+    template <typename... Args> static std::shared_ptr<Slot> make_slot(Args&&... args) {
+        auto buffer = std::allocate_shared<Buffer>(PoolAllocator<Buffer>(),
+                                                   std::forward<Args>(args)...);
+        return std::allocate_shared<Slot>(PoolAllocator<Slot>(), std::move(buffer));
+    }
+
     enum class Type { own, view };
-    const Type _type;
-    T* _data;
+    Type _type{Type::own};
+    // null for the empty storage and for views of external memory
+    std::shared_ptr<Slot> _slot;
+    size_t _origin{0};      // position of the first element in the buffer
+    T* _external{nullptr};  // the first element, for views of external memory
 
 public:
-    std::vector<size_t> strides;
-    std::vector<size_t> offsets;
+    Shape strides;
+    Shape offsets;
 
-    Storage(const std::initializer_list<size_t>& shape)
-        : _type(Type::own), offsets(shape.size(), 0) {
+    Storage() = default;  // no element, backs the empty tensor
+    Storage(const Shape& shape) : _type(Type::own), offsets(shape.size(), 0) {
         strides.resize(shape.size());
-        size_t size = 1, i = shape.size();
-        for (auto it = shape.end(); it != shape.begin();) {
-            --it;
-            --i;
+        size_t size = 1;
+        for (size_t i = shape.size(); i--;) {
             strides[i] = size;
-            size *= *it;
+            size *= shape[i];
         }
-        _data = new T[](size);
+        _slot = make_slot(size);
     }
-    Storage(T* data, std::vector<size_t>&& strides, std::vector<size_t>&& offsets)
-        : _type(Type::view), _data(data), strides(std::move(strides)),
-          offsets(std::move(offsets)) {}
-    ~Storage() {
-        if (_type == Type::own) delete[] _data;
+    Storage(T* data, Shape strides, Shape offsets)
+        : _type(Type::view), _external(data), strides(strides), offsets(offsets) {}
+    // a view of the `size` elements at `data`, which stay valid while `source` is alive
+    Storage(T* data, size_t size, Shape strides, Shape offsets,
+            std::shared_ptr<const void> source)
+        : _type(Type::view), strides(strides), offsets(offsets) {
+        _slot = make_slot(data, size, std::move(source));
     }
+    // leaves `other` as the empty storage
+    Storage(Storage&& other) noexcept
+        : _type(std::exchange(other._type, Type::own)), _slot(std::move(other._slot)),
+          _origin(std::exchange(other._origin, 0)),
+          _external(std::exchange(other._external, nullptr)),
+          strides(std::move(other.strides)), offsets(std::move(other.offsets)) {
+        other.strides.clear(), other.offsets.clear();
+    }
+    Storage& operator=(Storage&& other) noexcept {
+        std::swap(_type, other._type), std::swap(_slot, other._slot);
+        std::swap(_origin, other._origin), std::swap(_external, other._external);
+        std::swap(strides, other.strides), std::swap(offsets, other.offsets);
+        return *this;
+    }
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
 
-    T* data() { return _data; }
+    // another owner of the same buffer
+    Storage share() const {
+        Storage storage;
+        if (_slot)
+            storage._slot = std::allocate_shared<Slot>(PoolAllocator<Slot>(), *_slot);
+        storage._origin = _origin, storage._external = _external;
+        storage.strides = strides, storage.offsets = offsets;
+        return storage;
+    }
+    // a view into the same elements, its first element at `data() + origin`
+    Storage view(size_t origin, Shape strides, Shape offsets) const {
+        Storage storage(_external ? _external + origin : nullptr, strides, offsets);
+        storage._slot = _slot, storage._origin = _origin + origin;
+        return storage;
+    }
+    // the buffer is also owned by another storage
+    bool shared() const { return _slot && _slot->buffer.use_count() > 1; }
+    // some view looks into the elements of this owner
+    bool viewed() const { return _slot && _slot.use_count() > 1; }
+    // make the buffer of this storage, and of the views sharing its slot, the only
+    // owner of its elements, before writing to them. External elements kept alive by a
+    // `source` are read-only, and copied on the first write.
+    void detach() {
+        if (!shared() && !(_slot && _slot->buffer->source)) return;
+        auto& buffer = _slot->buffer;
+        auto copy = std::allocate_shared<Buffer>(PoolAllocator<Buffer>(), buffer->size);
+        std::copy_n(buffer->elements, buffer->size, copy->elements);
+        buffer = std::move(copy);
+    }
 
-    auto& operator[](this auto& self, std::vector<size_t> idx) {
+    T* data() const { return _slot ? _slot->buffer->elements + _origin : _external; }
+
+    // owned storage is laid out row-major with no offset
+    bool owning() const { return _type == Type::own; }
+
+    size_t offset(const Shape& idx) const {
         size_t index = 0;
-        size_t i = 0;
-        for (auto arg : idx) {
-            index += (arg + self.offsets[i]) * self.strides[i];
-            ++i;
+        for (size_t i = 0; i < idx.size(); i++) {
+            index += (idx[i] + offsets[i]) * strides[i];
         }
-        return self._data[index];
+        return index;
+    }
+    template <typename... Args> size_t offset(size_t first, Args... args) const {
+        size_t index = 0, i = 0;
+        for (size_t arg : {first, static_cast<size_t>(args)...}) {
+            index += (arg + offsets[i]) * strides[i];
+            i++;
+        }
+        return index;
+    }
+
+    auto& operator[](this auto& self, const Shape& idx) {
+        return self.data()[self.offset(idx)];
     }
-    auto& operator[](this auto self, size_t first, auto... args) {
-        return self[std::vector{first, args...}];
+    auto& operator[](this auto& self, size_t first, auto... args) {
+        return self.data()[self.offset(first, args...)];
     }
 };
 
@@ -56,22 +224,304 @@ struct SliceRange {
     }
 };
 
-template <typename T> class Tensor {
+// Element-wise loops over strided operands.
+//
+// An operation over a shape takes one stride vector per operand, the output first, with
+// stride 0 along the dimensions an input is broadcast over. `loop` drops dimensions of
+// size 1 and merges neighbouring dimensions that every operand steps through as one (a
+// contiguous tensor becomes a single run, a bias added to a matrix one run per row),
+// then walks the outer dimensions and hands each innermost run to a row kernel. The
+// `unary` and `binary` kernels have dedicated loops for unit and zero strides, which the
+// compiler vectorizes with the operation inlined.
+namespace elementwise {
+template <size_t N> using Strides = std::array<Shape, N>;
+
+template <size_t N> void coalesce(Shape& shape, Strides<N>& strides) {
+    Shape merged;
+    Strides<N> merged_strides;
+    for (size_t i = 0; i < shape.size(); i++) {
+        if (shape[i] == 1) continue;
+        bool merge = !merged.empty();
+        for (size_t k = 0; k < N && merge; k++)
+            merge = merged_strides[k].back() == strides[k][i] * shape[i];
+        if (merge) {
+            merged.back() *= shape[i];
+            for (size_t k = 0; k < N; k++) merged_strides[k].back() = strides[k][i];
+            continue;
+        }
+        merged.push_back(shape[i]);
+        for (size_t k = 0; k < N; k++) merged_strides[k].push_back(strides[k][i]);
+    }
+    shape = merged, strides = merged_strides;
+}
+
+// Call `row(n, offsets, steps)` for every innermost run of `shape`: n elements, the
+// first of operand k at `offsets[k]` and the next ones `steps[k]` apart.
+template <size_t N, typename Row> void loop(Shape shape, Strides<N> strides, Row&& row) {
+    for (auto n : shape)
+        if (n == 0) return;
+    coalesce(shape, strides);
+    std::array<size_t, N> offsets{}, steps{};
+    if (shape.empty()) return row(size_t(1), offsets, steps);
+    size_t rank = shape.size();
+    for (size_t k = 0; k < N; k++) steps[k] = strides[k][rank - 1];
+    Shape idx(rank - 1, 0);
+    while (true) {
+        row(shape[rank - 1], offsets, steps);
+        for (size_t d = rank - 1;;) {
+            if (d == 0) return;
+            d--;
+            for (size_t k = 0; k < N; k++) offsets[k] += strides[k][d];
+            if (++idx[d] < shape[d]) break;
+            for (size_t k = 0; k < N; k++) offsets[k] -= strides[k][d] * shape[d];
+            idx[d] = 0;
+        }
+    }
+}
+
+// out[i] = f(a[i]) for i in [0, n), with the given strides
+template <typename R, typename A, typename F>
+void unary_row(size_t n, R* out, size_t so, const A* a, size_t sa, F& f) {
+    if (so == 1 && sa == 1) {
+        for (size_t i = 0; i < n; i++) out[i] = f(a[i]);
+    } else if (so == 1 && sa == 0) {
+        std::fill_n(out, n, R(f(*a)));
+    } else {
+        for (size_t i = 0; i < n; i++) out[i * so] = f(a[i * sa]);
+    }
+}
+
+// out[i] = f(a[i], b[i]) for i in [0, n), with the given strides
+template <typename R, typename A, typename B, typename F>
+void binary_row(size_t n, R* out, size_t so, const A* a, size_t sa, const B* b,
+                size_t sb, F& f) {
+    if (so == 1 && sa == 1 && sb == 1) {
+        for (size_t i = 0; i < n; i++) out[i] = f(a[i], b[i]);
+    } else if (so == 1 && sa == 1 && sb == 0) {
+        B y = *b;
+        for (size_t i = 0; i < n; i++) out[i] = f(a[i], y);
+    } else if (so == 1 && sa == 0 && sb == 1) {
+        A x = *a;
+        for (size_t i = 0; i < n; i++) out[i] = f(x, b[i]);
+    } else {
+        for (size_t i = 0; i < n; i++) out[i * so] = f(a[i * sa], b[i * sb]);
+    }
+}
+
+template <typename R, typename A, typename F>
+void unary(const Shape& shape, const Strides<2>& strides, R* out, const A* a, F&& f) {
+    loop<2>(shape, strides, [&](size_t n, const auto& offsets, const auto& steps) {
+        unary_row(n, out + offsets[0], steps[0], a + offsets[1], steps[1], f);
+    });
+}
+
+template <typename R, typename A, typename B, typename F>
+void binary(const Shape& shape, const Strides<3>& strides, R* out, const A* a, const B* b,
+            F&& f) {
+    loop<3>(shape, strides, [&](size_t n, const auto& offsets, const auto& steps) {
+        binary_row(n, out + offsets[0], steps[0], a + offsets[1], steps[1],
+                   b + offsets[2], steps[2], f);
+    });
+}
+}  // namespace elementwise
+
+// Reductions along one dimension of a strided tensor.
+//
+// An operation folds elements into an accumulator (`add`) and combines accumulators
+// (`merge`). The elements of an output are folded in runs of at most `block`, and the
+// runs are merged over a pairwise tree whose shape only depends on their number; threads
+// only decide who computes which subtree, so the result does not depend on the number of
+// threads, and sums get the error growth of pairwise summation. Large reductions run on
+// the shared `ThreadPool`, split into groups of outputs, or into subtrees when there are
+// too few outputs to go around. When the reduced dimension is not the innermost one,
+// `lanes` neighbouring outputs are folded side by side, so that the inner loop reads
+// contiguous elements; otherwise four interleaved accumulators break the dependency
+// chain of the fold.
+namespace reduction {
+inline constexpr size_t block = 256;      // elements folded in sequence
+inline constexpr size_t grain = 1 << 16;  // elements per task
+inline constexpr size_t lanes = 8;
+
+template <typename T> struct Sum {
+    using Acc = T;
+    using Out = T;
+    static Acc init() { return T{}; }
+    static void add(Acc& acc, const T& x, size_t) { acc += x; }
+    static Acc merge(const Acc& a, const Acc& b) { return a + b; }
+    static Out result(const Acc& acc) { return acc; }
+};
+
+// Euclidean norm: square root of the sum of squares
+template <typename T> struct Norm : Sum<T> {
+    static void add(T& acc, const T& x, size_t) { acc += x * x; }
+    static T result(const T& acc) {
+        using std::sqrt;
+        return sqrt(acc);
+    }
+};
+
+// index of the first of the largest elements
+template <typename T> struct ArgMax {
+    static constexpr size_t none = size_t(-1);
+    struct Acc {
+        T value;
+        size_t index;
+    };
+    using Out = size_t;
+    static Acc init() { return {T{}, none}; }
+    static void add(Acc& acc, const T& x, size_t i) {
+        if (acc.index == none || x > acc.value) acc = {x, i};
+    }
+    static Acc merge(const Acc& a, const Acc& b) {
+        if (a.index == none || b.index == none) return a.index == none ? b : a;
+        bool right = b.value > a.value || (b.value == a.value && b.index < a.index);
+        return right ? b : a;
+    }
+    static Out result(const Acc& acc) { return acc.index; }
+};
+
+template <typename T> struct Max : ArgMax<T> {
+    using Out = T;
+    static Out result(const typename ArgMax<T>::Acc& acc) { return acc.value; }
+};
+
+// end of the left half of [begin, end), a whole number of blocks
+inline size_t middle(size_t begin, size_t end) {
+    size_t blocks = (end - begin + block - 1) / block;
+    return begin + (blocks + 1) / 2 * block;
+}
+
+// `leaf` over the runs of [begin, end), merged pairwise
+template <typename Acc, typename Leaf, typename Merge>
+Acc tree(size_t begin, size_t end, const Leaf& leaf, const Merge& merge) {
+    if (end - begin <= block) return leaf(begin, end);
+    size_t mid = middle(begin, end);
+    Acc left = tree<Acc>(begin, mid, leaf, merge);
+    return merge(left, tree<Acc>(mid, end, leaf, merge));
+}
+
+// the subtrees of at most `grain` elements of `tree(begin, end)`, in order
+template <typename F> void subtrees(size_t begin, size_t end, F& f) {
+    if (end - begin <= grain) return f(begin, end);
+    size_t mid = middle(begin, end);
+    subtrees(begin, mid, f), subtrees(mid, end, f);
+}
+template <typename Acc, typename Merge>
+Acc merge_subtrees(size_t begin, size_t end, const Acc*& partial, const Merge& merge) {
+    if (end - begin <= grain) return *partial++;
+    size_t mid = middle(begin, end);
+    Acc left = merge_subtrees(begin, mid, partial, merge);
+    return merge(left, merge_subtrees(mid, end, partial, merge));
+}
+
+// `tree(0, n)`, with its subtrees computed as parallel tasks
+template <typename Acc, typename Leaf, typename Merge>
+Acc parallel_tree(size_t n, const Leaf& leaf, const Merge& merge) {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    auto collect = [&](size_t begin, size_t end) { ranges.emplace_back(begin, end); };
+    subtrees(0, n, collect);
+    std::vector<Acc> partials(ranges.size());
+    ThreadPool::shared().run(ranges.size(), [&](size_t i) {
+        partials[i] = tree<Acc>(ranges[i].first, ranges[i].second, leaf, merge);
+    });
+    const Acc* partial = partials.data();
+    return merge_subtrees(size_t(0), n, partial, merge);
+}
+
+// Reduce `x` with `Op` along a dimension of `n` elements `step` apart. The other
+// dimensions of `x` are `shape`, with `strides`; `out` is row-major over them.
+template <typename Op, typename T>
+void reduce(const T* x, size_t n, size_t step, Shape shape, Shape strides,
+            typename Op::Out* out) {
+    using Acc = typename Op::Acc;
+    using Group = std::array<Acc, lanes>;
+    elementwise::Strides<1> merged{strides};
+    elementwise::coalesce(shape, merged);
+    strides = merged[0];
+    if (shape.empty()) shape.push_back(1), strides.push_back(0);
+    size_t rank = shape.size(), inner = shape[rank - 1], inner_stride = strides[rank - 1];
+    size_t width = inner_stride == 1 && step != 1 ? lanes : 1;
+    size_t per_row = (inner + width - 1) / width, groups = per_row;
+    for (size_t d = 0; d + 1 < rank; d++) groups *= shape[d];
+
+    // outputs [j, j + w) of a row, where row and j come from the group index
+    auto compute = [&](size_t g, bool parallel) {
+        size_t row = g / per_row, j = g % per_row * width, w = std::min(width, inner - j);
+        size_t offset = j * inner_stride;
+        for (size_t d = rank - 1, r = row; d-- > 0; r /= shape[d])
+            offset += r % shape[d] * strides[d];
+        const T* p = x + offset;
+        auto leaf = [&](size_t begin, size_t end) {
+            Group acc;
+            acc.fill(Op::init());
+            if (w > 1) {
+                for (size_t i = begin; i < end; i++) {
+                    const T* r = p + i * step;
+                    for (size_t l = 0; l < w; l++) Op::add(acc[l], r[l], i);
+                }
+                return acc;
+            }
+            size_t i = begin;
+            for (; i + 4 <= end; i += 4) {
+                for (size_t l = 0; l < 4; l++) Op::add(acc[l], p[(i + l) * step], i + l);
+            }
+            for (; i < end; i++) Op::add(acc[0], p[i * step], i);
+            acc[0] = Op::merge(Op::merge(acc[0], acc[1]), Op::merge(acc[2], acc[3]));
+            return acc;
+        };
+        auto merge = [&](const Group& a, const Group& b) {
+            Group acc;
+            for (size_t l = 0; l < w; l++) acc[l] = Op::merge(a[l], b[l]);
+            return acc;
+        };
+        Group acc = parallel ? parallel_tree<Group>(n, leaf, merge)
+                             : tree<Group>(0, n, leaf, merge);
+        for (size_t l = 0; l < w; l++) out[row * inner + j + l] = Op::result(acc[l]);
+    };
+
+    auto& pool = ThreadPool::shared();
+    size_t per_group = std::max<size_t>(width * n, 1);
+    if (groups * per_group <= grain || pool.size() == 1) {
+        for (size_t g = 0; g < groups; g++) compute(g, false);
+    } else if (groups < pool.size()) {
+        for (size_t g = 0; g < groups; g++) compute(g, true);
+    } else {
+        size_t per_task = std::max<size_t>(grain / per_group, 1);
+        pool.run((groups + per_task - 1) / per_task, [&](size_t t) {
+            size_t end = std::min(groups, (t + 1) * per_task);
+            for (size_t g = t * per_task; g < end; g++) compute(g, false);
+        });
+    }
+}
+}  // namespace reduction
+
+// `Tensor<T>` has its shape set at run time; `Tensor<T, Dims...>` has the shape `Dims`
+// fixed at compile time and is defined in fixed_tensor.hpp.
+template <typename T, size_t... Dims> class Tensor;
+
+// N-dimensional array of `T`, owning its elements or looking into another tensor's.
+//
+// Tensors are values: copies share their elements until one is written (see `Storage`),
+// and arithmetic, comparisons (which yield a `Tensor<bool>`) and math functions apply
+// element-wise, with operands of different shapes broadcast as in NumPy (see
+// `broadcast`). The default-constructed tensor is empty and counts as zero of any shape,
+// so that it can start a sum of gradients.
+template <typename T> class Tensor<T> {
     Storage<T> _storage;
-    std::vector<size_t> _shape;
-    size_t _size;
+    Shape _shape;
+    size_t _size{0};
     struct IndexIterator {
-        const std::vector<size_t>& shape;
-        std::vector<size_t> idx;
+        const Shape& shape;
+        Shape idx;
         bool done;
 
-        IndexIterator(const std::vector<size_t>& shape, bool done = false)
+        IndexIterator(const Shape& shape, bool done = false)
             : shape(shape), idx(shape.size(), 0), done(done) {
             if (shape.empty()) this->done = true;
         }
-        std::vector<size_t> operator*() const { return idx; }
+        const Shape& operator*() const { return idx; }
         IndexIterator& operator++() {
-            for (int i = static_cast<int>(idx.size()) - 1; i >= 0; --i) {
+            for (size_t i = idx.size(); i--;) {
                 idx[i]++;
                 if (idx[i] < shape[i]) return *this;
                 idx[i] = 0;
@@ -83,65 +533,509 @@ template <typename T> class Tensor {
     };
 
     struct IndexRange {
-        const std::vector<size_t>& shape;
-        IndexRange(const std::vector<size_t>& shape) : shape(shape) {}
+        const Shape& shape;
+        IndexRange(const Shape& shape) : shape(shape) {}
         IndexIterator begin() const { return IndexIterator(shape); }
         IndexIterator end() const { return IndexIterator(shape, true); }
     };
 
     IndexRange indexes() const { return IndexRange(_shape); }
 
+    static size_t count(const Shape& shape) {
+        size_t size = 1;
+        for (auto n : shape) size *= n;
+        return size;
+    }
+
+    static Shape row_major(const Shape& shape) {
+        Shape strides(shape.size());
+        size_t stride = 1;
+        for (size_t i = shape.size(); i--;) strides[i] = stride, stride *= shape[i];
+        return strides;
+    }
+
+    template <typename, size_t...> friend class Tensor;
+
+    // position of the element at index (0, ..., 0) in the storage
+    size_t origin() const { return _storage.offset(Shape(_shape.size(), 0)); }
+    const T* base() const { return _storage.data() + origin(); }
+    const T& first() const { return *base(); }
+
+    // strides that step through this tensor broadcast to `shape`: 0 along the dimensions
+    // it is repeated over
+    Shape strides_for(const Shape& shape) const {
+        Shape strides(shape.size(), 0);
+        size_t lead = shape.size() - _shape.size();
+        for (size_t i = 0; i < _shape.size(); i++) {
+            if (_shape[i] != 1) strides[lead + i] = _storage.strides[i];
+        }
+        return strides;
+    }
+
+    // View of shape `shape` into the elements of this tensor, element `idx` at
+    // `origin + sum(idx[i] * strides[i])`. It shares the elements of this tensor even
+    // when other owners do; writing through it detaches as the tensor would (see
+    // `Storage`).
+    Tensor alias(size_t origin, const Shape& shape, const Shape& strides) const {
+        return Tensor(_storage.view(origin, strides, Shape(shape.size(), 0)), shape);
+    }
+
+    // the elements in row-major order: those of this tensor if it is contiguous,
+    // otherwise those of a copy made into `copy`
+    const T* elements(Tensor& copy) const {
+        if (is_contiguous()) return _storage.data();
+        copy = *this;
+        return copy._storage.data();
+    }
+
+    bool shareable() const { return _storage.owning() && !_storage.viewed(); }
+
+    // write the elements of `other`, of the same shape
+    void copy_from(const Tensor& other) {
+        if (empty()) return;
+        _storage.detach();
+        elementwise::unary(_shape, {_storage.strides, other._storage.strides},
+                           _storage.data() + origin(), other.base(), std::identity());
+    }
+
 public:
     auto& shape() { return _shape; }
     const auto& shape() const { return _shape; }
     const auto& storage() const { return _storage; }
     size_t size() const { return _size; }
-    T* data() const { return _storage._data(); }
+    // the non-const overload detaches a shared buffer, as it may be used to write
+    const T* data() const { return _storage.data(); }
+    T* data() {
+        _storage.detach();
+        return _storage.data();
+    }
+    bool empty() const { return _shape.empty(); }
 
+    Tensor() = default;
     Tensor(T value) : _storage({1}), _shape({1}), _size(1) { _storage[0] = value; }
-    Tensor(Storage<T>&& storage, std::vector<size_t>&& shape)
-        : _storage(std::move(storage)), _shape(std::move(shape)) {}
-    Tensor(std::initializer_list<size_t> shape) : _storage(shape), _shape(shape) {}
+    Tensor(Storage<T>&& storage, const Shape& shape)
+        : _storage(std::move(storage)), _shape(shape), _size(count(shape)) {}
+    explicit Tensor(const Shape& shape)
+        : _storage(shape), _shape(shape), _size(count(shape)) {}
+    Tensor(std::initializer_list<size_t> shape) : Tensor(Shape(shape)) {}
     Tensor(std::initializer_list<size_t> shape, std::initializer_list<T> value)
-        : _storage(shape), _shape(shape) {
-        size_t i = 0;
-        for (auto it = value.begin(); it != value.end(); ++it) {
-            _storage[i] = *it;
-            ++i;
+        : Tensor(shape) {
+        if (value.size() != _size)
+            runtimeError("{} values for a tensor of shape {}", value.size(), _shape);
+        std::copy_n(value.begin(), _size, data());
+    }
+    // shares the buffer of an owning `other` unless views look into it, copies otherwise
+    Tensor(const Tensor& other) : _shape(other._shape), _size(other._size) {
+        if (other.shareable()) {
+            _storage = other._storage.share();
+            return;
+        }
+        if (!empty()) _storage = Storage<T>(_shape);
+        copy_from(other);
+    }
+    // leaves `other` empty, so that it can still be assigned to
+    Tensor(Tensor&& other) noexcept
+        : _storage(std::move(other._storage)),
+          _shape(std::exchange(other._shape, Shape())),
+          _size(std::exchange(other._size, 0)) {}
+
+    // elements are `data()[0, size())` in row-major order, so that element-wise loops
+    // can run on linear offsets instead of multi-dimensional indices
+    bool is_contiguous() const {
+        if (_storage.owning()) return true;
+        size_t stride = 1;
+        for (size_t i = _shape.size(); i--;) {
+            if (_storage.offsets[i] != 0) return false;
+            if (_shape[i] != 1 && _storage.strides[i] != stride) return false;
+            stride *= _shape[i];
         }
+        return true;
+    }
+
+    // a view of this tensor if it is contiguous, otherwise a contiguous copy
+    Tensor contiguous() const {
+        if (is_contiguous()) return alias(0, _shape, _storage.strides);
+        Tensor copy(*this);
+        return copy;
+    }
+
+    auto& operator[](this auto& self, size_t first, auto... args) {
+        if constexpr (!std::is_const_v<std::remove_reference_t<decltype(self)>>)
+            self._storage.detach();
+        return self._storage[first, args...];
     }
 
-    Tensor<T> operator=(const Tensor<T>& other) {
+    // the element of a one-element tensor
+    T item() const {
+        if (_size != 1) runtimeError("item of a tensor of shape {}", _shape);
+        return first();
+    }
+
+    // An owning tensor takes the value of `other` (see the copy constructor), while a
+    // view writes through to the elements it looks into, so the shapes must match.
+    Tensor<T>& operator=(const Tensor<T>& other) {
         if (this == &other) return *this;
+        // an unshared buffer of the right shape is reused for a copy
+        bool reuse = _shape == other._shape && !other.shareable() && shareable() &&
+                     !_storage.shared();
+        if (_storage.owning() && !reuse) return *this = Tensor(other);
         if (_shape != other._shape)
             runtimeError("shape not match: {} vs {}", _shape, other._shape);
-        for (size_t i = 0; i < _shape.size(); ++i) {
-            if (_shape[i] != other._shape[i])
-                runtimeError("shape not match: {} vs {}", _shape, other._shape);
-        }
-        for (auto idx : this->indexes()) {
-            this->_storage[idx] = other._storage[idx];
-        }
+        copy_from(other);
+        return *this;
+    }
+    Tensor<T>& operator=(Tensor<T>&& other) {
+        if (this == &other) return *this;
+        if (!_storage.owning()) return *this = std::as_const(other);
+        _storage = std::move(other._storage);
+        _shape = std::exchange(other._shape, Shape());
+        _size = std::exchange(other._size, 0);
         return *this;
     }
 
     bool operator==(const Tensor<T>& other) const {
         if (_shape != other._shape) return false;
-        for (size_t i = 0; i < _shape.size(); ++i) {
-            if (_shape[i] != other._shape[i]) return false;
-        }
-        for (auto idx : this->indexes()) {
+        if (is_contiguous() && other.is_contiguous())
+            return std::equal(data(), data() + _size, other.data());
+        for (const auto& idx : this->indexes()) {
             if (this->_storage[idx] != other._storage[idx]) return false;
         }
         return true;
     }
 
-    // Tensor<T> initial_diff() const override {
-    //     if (_shape.size() > 1) {
-    //         runtimeError("can not backward tensor with multiple dimension");
-    //     }
-    //     return Tensor<T>(1);
-    // }
+    // element-wise `f(x)`
+    template <typename F> auto map(F&& f) const {
+        using R = std::remove_cvref_t<std::invoke_result_t<F&, const T&>>;
+        if (empty()) return Tensor<R>();
+        Tensor<R> out(_shape);
+        elementwise::unary(_shape, {out._storage.strides, _storage.strides},
+                           out._storage.data(), base(), f);
+        return out;
+    }
+
+    // NumPy broadcasting: shapes are aligned on their last dimension, where each pair of
+    // dimensions must be equal or contain a 1, and the shorter one is padded with 1s
+    static Shape broadcast(const Shape& a, const Shape& b) {
+        size_t rank = std::max(a.size(), b.size());
+        Shape shape(rank);
+        for (size_t i = 0; i < rank; i++) {
+            size_t x = i + a.size() < rank ? 1 : a[i + a.size() - rank];
+            size_t y = i + b.size() < rank ? 1 : b[i + b.size() - rank];
+            if (x != y && x != 1 && y != 1)
+                runtimeError("can not broadcast tensors of shape {} and {}", a, b);
+            shape[i] = x == 1 ? y : x;
+        }
+        return shape;
+    }
+
+    // element-wise `f(x, y)` over the broadcast shape of `a` and `b`
+    template <typename F> static auto zip(F&& f, const Tensor& a, const Tensor& b) {
+        using R = std::remove_cvref_t<std::invoke_result_t<F&, const T&, const T&>>;
+        if (a.empty() || b.empty())
+            runtimeError("element-wise operation on tensors of shape {} and {}", a._shape,
+                         b._shape);
+        Shape shape = broadcast(a._shape, b._shape);
+        Tensor<R> out(shape);
+        elementwise::Strides<3> strides{out._storage.strides, a.strides_for(shape),
+                                        b.strides_for(shape)};
+        elementwise::binary(shape, strides, out._storage.data(), a.base(), b.base(), f);
+        return out;
+    }
+
+    // `mask ? a : b` element by element, over the broadcast shape of the three
+    static Tensor select(const Tensor<bool>& mask, const Tensor& a, const Tensor& b) {
+        Shape shape = broadcast(broadcast(mask._shape, a._shape), b._shape);
+        Tensor out(shape);
+        T* o = out._storage.data();
+        const bool* m = mask.base();
+        const T *x = a.base(), *y = b.base();
+        elementwise::Strides<4> strides{out._storage.strides, mask.strides_for(shape),
+                                        a.strides_for(shape), b.strides_for(shape)};
+        auto row = [&](size_t n, const auto& at, const auto& by) {
+            for (size_t i = 0; i < n; i++) {
+                o[at[0] + i * by[0]] =
+                    m[at[1] + i * by[1]] ? x[at[2] + i * by[2]] : y[at[3] + i * by[3]];
+            }
+        };
+        elementwise::loop<4>(shape, strides, row);
+        return out;
+    }
+
+    friend Tensor operator-(const Tensor& a) { return a.map(std::negate<>()); }
+    friend Tensor operator+(const Tensor& a, const Tensor& b) {
+        return zip(std::plus<>(), a, b);
+    }
+    friend Tensor operator-(const Tensor& a, const Tensor& b) {
+        return zip(std::minus<>(), a, b);
+    }
+    friend Tensor operator*(const Tensor& a, const Tensor& b) {
+        return zip(std::multiplies<>(), a, b);
+    }
+    friend Tensor operator/(const Tensor& a, const Tensor& b) {
+        return zip(std::divides<>(), a, b);
+    }
+    // `==` compares whole tensors, the others element by element
+    friend Tensor<bool> operator<(const Tensor& a, const Tensor& b) {
+        return zip(std::less<>(), a, b);
+    }
+    friend Tensor<bool> operator<=(const Tensor& a, const Tensor& b) {
+        return zip(std::less_equal<>(), a, b);
+    }
+    friend Tensor<bool> operator>(const Tensor& a, const Tensor& b) {
+        return zip(std::greater<>(), a, b);
+    }
+    friend Tensor<bool> operator>=(const Tensor& a, const Tensor& b) {
+        return zip(std::greater_equal<>(), a, b);
+    }
+
+#define TENSOR_UNARY_FUNC(func)                                                   \
+    friend Tensor func(const Tensor& a) {                                         \
+        return a.map([](const T& x) -> T { return std::func(x); });               \
+    }
+    TENSOR_UNARY_FUNC(log)
+    TENSOR_UNARY_FUNC(exp)
+    TENSOR_UNARY_FUNC(sin)
+    TENSOR_UNARY_FUNC(cos)
+    TENSOR_UNARY_FUNC(tan)
+    TENSOR_UNARY_FUNC(asin)
+    TENSOR_UNARY_FUNC(acos)
+    TENSOR_UNARY_FUNC(atan)
+    TENSOR_UNARY_FUNC(sinh)
+    TENSOR_UNARY_FUNC(cosh)
+    TENSOR_UNARY_FUNC(tanh)
+    TENSOR_UNARY_FUNC(sqrt)
+    TENSOR_UNARY_FUNC(abs)
+#undef TENSOR_UNARY_FUNC
+    friend Tensor pow(const Tensor& a, const Tensor& b) {
+        return zip([](const T& x, const T& y) -> T { return std::pow(x, y); }, a, b);
+    }
+
+    // in place when `other` broadcasts to the shape of this tensor
+    Tensor& operator+=(const Tensor& other) {
+        if (other.empty()) return *this;
+        if (empty()) return *this = other;
+        if (broadcast(_shape, other._shape) != _shape) return *this = *this + other;
+        _storage.detach();
+        T* out = _storage.data() + origin();
+        const Shape& own = _storage.strides;
+        elementwise::binary(_shape, {own, own, other.strides_for(_shape)}, out, out,
+                            other.base(), std::plus<>());
+        return *this;
+    }
+
+    // sum over the dimensions along which `shape` is broadcast to the shape of this
+    // tensor, e.g. the gradient of a bias added to every row of a matrix
+    Tensor sum_to(const Shape& shape) const {
+        if (broadcast(shape, _shape) != _shape)
+            runtimeError("can not sum a tensor of shape {} to {}", _shape, shape);
+        Tensor out(shape);
+        T* o = out._storage.data();
+        Shape strides = out.strides_for(_shape);
+        elementwise::binary(_shape, {strides, strides, _storage.strides}, o, o, base(),
+                            std::plus<>());
+        return out;
+    }
+
+    // Gradients on the tape (see `Operation::accumulate`) take the shape of the value
+    // they belong to: a gradient reaching an operand that was broadcast is summed over
+    // the broadcast dimensions, and a one-element one (e.g. the seed of `propagate`) is
+    // broadcast.
+    friend void add_diff(Tensor& target, const Tensor& diff, const Tensor& value) {
+        if (diff.empty()) return;
+        if (diff._shape != value._shape && diff._size != 1)
+            return add_diff(target, diff.sum_to(value._shape), value);
+        if (target.empty() && diff._shape == value._shape) {
+            target = diff;
+            return;
+        }
+        if (target.empty()) target = Tensor(value._shape);
+        target += diff;
+    }
+
+    // Reductions (see `reduction`), over all elements or along `axis`. The axis is
+    // dropped from the shape unless `keepdim`; a result without dimensions left has
+    // shape {1}. `argmax()` is the row-major index of the first largest element.
+    T sum() const { return fold<reduction::Sum<T>>(); }
+    Tensor sum(size_t axis, bool keepdim = false) const {
+        return reduce<reduction::Sum<T>>(axis, keepdim);
+    }
+    T mean() const { return sum() / T(_size); }
+    Tensor mean(size_t axis, bool keepdim = false) const {
+        Tensor out = sum(axis, keepdim);
+        T n = T(_shape[axis]);
+        for (T* x = out.data(); x != out.data() + out._size; x++) *x /= n;
+        return out;
+    }
+    T max() const { return fold<reduction::Max<T>>(); }
+    Tensor max(size_t axis, bool keepdim = false) const {
+        return reduce<reduction::Max<T>>(axis, keepdim);
+    }
+    size_t argmax() const { return fold<reduction::ArgMax<T>>(); }
+    Tensor<size_t> argmax(size_t axis, bool keepdim = false) const {
+        return reduce<reduction::ArgMax<T>>(axis, keepdim);
+    }
+    T norm() const { return fold<reduction::Norm<T>>(); }
+    Tensor norm(size_t axis, bool keepdim = false) const {
+        return reduce<reduction::Norm<T>>(axis, keepdim);
+    }
+
+    // max and argmax have no value for no element
+    template <typename Op> static constexpr bool has_identity =
+        !std::is_base_of_v<reduction::ArgMax<T>, Op>;
+
+    template <typename Op> typename Op::Out fold() const {
+        if (_size == 0 && !has_identity<Op>)
+            runtimeError("reduction of a tensor of shape {} with no element", _shape);
+        Tensor copy;
+        const T* x = elements(copy);
+        typename Op::Out out;
+        reduction::reduce<Op>(x, _size, 1, Shape(), Shape(), &out);
+        return out;
+    }
+    template <typename Op>
+    Tensor<typename Op::Out> reduce(size_t axis, bool keepdim) const {
+        if (axis >= _shape.size())
+            runtimeError("no axis {} in a tensor of shape {}", axis, _shape);
+        Shape shape, strides;
+        for (size_t d = 0; d < _shape.size(); d++) {
+            if (d == axis && keepdim) shape.push_back(1), strides.push_back(0);
+            if (d == axis) continue;
+            shape.push_back(_shape[d]), strides.push_back(_storage.strides[d]);
+        }
+        Tensor<typename Op::Out> out(shape.empty() ? Shape{1} : shape);
+        size_t n = _shape[axis];
+        if (n == 0 && !has_identity<Op>)
+            runtimeError("reduction along an empty axis of shape {}", _shape);
+        reduction::reduce<Op>(base(), n, _storage.strides[axis], shape, strides,
+                              out._storage.data());
+        return out;
+    }
+
+    // Views: O(1), they write through to the elements of this tensor and keep them alive.
+
+    // `ranges[i]` selects along dimension i: a single index drops the dimension, a
+    // `{start, end[, step]}` range keeps it; dimensions past the ranges are kept whole
+    Tensor slice(std::initializer_list<SliceRange> ranges) const {
+        if (ranges.size() > _shape.size())
+            runtimeError("{} ranges for a tensor of shape {}", ranges.size(), _shape);
+        size_t base = origin();
+        Shape shape, strides;
+        size_t i = 0;
+        for (const auto& range : ranges) {
+            size_t n = _shape[i], stride = _storage.strides[i++];
+            if (range.step == 0) {
+                if (range.start >= n) runtimeError("index {} out of {}", range.start, n);
+                base += range.start * stride;
+                continue;
+            }
+            size_t end = std::min(range.end, n);
+            if (range.start > end) runtimeError("empty range {}..{}", range.start, end);
+            base += range.start * stride;
+            shape.push_back((end - range.start + range.step - 1) / range.step);
+            strides.push_back(stride * range.step);
+        }
+        for (; i < _shape.size(); i++) {
+            shape.push_back(_shape[i]);
+            strides.push_back(_storage.strides[i]);
+        }
+        return alias(base, shape, strides);
+    }
+
+    // dimension i of the view is dimension `dims[i]` of this tensor
+    Tensor permute(const Shape& dims) const {
+        size_t rank = _shape.size();
+        Shape shape(rank), strides(rank), seen(rank, 0);
+        if (dims.size() != rank)
+            runtimeError("permute a tensor of shape {} by {}", _shape, dims);
+        for (size_t i = 0; i < rank; i++) {
+            if (dims[i] >= rank || seen[dims[i]]++)
+                runtimeError("permute a tensor of shape {} by {}", _shape, dims);
+            shape[i] = _shape[dims[i]], strides[i] = _storage.strides[dims[i]];
+        }
+        return alias(origin(), shape, strides);
+    }
+
+    Tensor transpose(size_t dim0, size_t dim1) const {
+        Shape dims(_shape.size());
+        std::iota(dims.begin(), dims.end(), size_t(0));
+        if (dim0 >= dims.size() || dim1 >= dims.size())
+            runtimeError("transpose dimensions {} and {} of {}", dim0, dim1, _shape);
+        std::swap(dims[dim0], dims[dim1]);
+        return permute(dims);
+    }
+    // the last two dimensions swapped
+    Tensor transpose() const {
+        size_t rank = _shape.size();
+        if (rank < 2) runtimeError("can not transpose a tensor of shape {}", _shape);
+        return transpose(rank - 2, rank - 1);
+    }
+
+    // same elements in row-major order with shape `shape`; the tensor must be contiguous
+    Tensor view(const Shape& shape) const {
+        if (count(shape) != _size)
+            runtimeError("can not reshape a tensor of shape {} to {}", _shape, shape);
+        if (!is_contiguous())
+            runtimeError("view of a non-contiguous tensor of shape {}", _shape);
+        return alias(0, shape, row_major(shape));
+    }
+    // like `view`, but copies the elements if they are not contiguous
+    Tensor reshape(const Shape& shape) const {
+        if (is_contiguous()) return view(shape);
+        if (count(shape) != _size)
+            runtimeError("can not reshape a tensor of shape {} to {}", _shape, shape);
+        Tensor out(*this);
+        out._shape = shape;
+        out._storage.strides = row_major(shape);
+        out._storage.offsets = Shape(shape.size(), 0);
+        return out;
+    }
+
+    // without dimension `dim`, which must have size 1
+    Tensor squeeze(size_t dim) const {
+        if (dim >= _shape.size() || _shape[dim] != 1)
+            runtimeError("can not squeeze dimension {} of {}", dim, _shape);
+        Shape shape, strides;
+        for (size_t i = 0; i < _shape.size(); i++) {
+            if (i == dim) continue;
+            shape.push_back(_shape[i]), strides.push_back(_storage.strides[i]);
+        }
+        return alias(origin(), shape, strides);
+    }
+    // without any dimension of size 1
+    Tensor squeeze() const {
+        Shape shape, strides;
+        for (size_t i = 0; i < _shape.size(); i++) {
+            if (_shape[i] == 1) continue;
+            shape.push_back(_shape[i]), strides.push_back(_storage.strides[i]);
+        }
+        return alias(origin(), shape, strides);
+    }
+    // with a dimension of size 1 inserted before dimension `dim`
+    Tensor unsqueeze(size_t dim) const {
+        if (dim > _shape.size())
+            runtimeError("can not unsqueeze dimension {} of {}", dim, _shape);
+        Shape shape, strides;
+        for (size_t i = 0; i <= _shape.size(); i++) {
+            if (i == dim) shape.push_back(1), strides.push_back(0);
+            if (i == _shape.size()) break;
+            shape.push_back(_shape[i]), strides.push_back(_storage.strides[i]);
+        }
+        return alias(origin(), shape, strides);
+    }
+
+    // Broadcast to `shape`: dimensions of size 1 are repeated with stride 0, and new
+    // leading dimensions may be added. Writing through the view writes shared elements.
+    Tensor expand(const Shape& shape) const {
+        if (broadcast(_shape, shape) != shape)
+            runtimeError("can not expand a tensor of shape {} to {}", _shape, shape);
+        return alias(origin(), shape, strides_for(shape));
+    }
+
+    std::string toString() const {
+        Tensor copy;
+        const T* x = elements(copy);
+        return std::format("tensor({}, {})", _shape, ::toString(x, x + _size));
+    }
 
     static Tensor<T> zeros(std::initializer_list<size_t> shape) {
         return Tensor<T>(shape);
@@ -149,9 +1043,198 @@ public:
 
     static Tensor<T> ones(std::initializer_list<size_t> shape) {
         Tensor<T> t(shape);
-        for (auto idx : t.indexes()) {
-            t._storage[idx] = 1;
-        }
+        std::fill_n(t.data(), t.size(), T(1));
         return t;
     }
-};
\ No newline at end of file
+};
+
+// `mask ? then() : otherwise()` element by element, see `where` in variable.hpp
+template <typename F, typename G>
+auto where(const Tensor<bool>& mask, F&& then, G&& otherwise) {
+    auto a = then(), b = otherwise();
+    return decltype(a)::select(mask, a, b);
+}
+
+// Matrix product over the last two dimensions: (m, k) x (k, n) -> (m, n), and batched
+// (b, m, k) x (b, k, n) -> (b, m, n). A 2-D `rhs` is shared by every batch of `lhs`.
+template <typename T> Tensor<T> matmul(const Tensor<T>& lhs, const Tensor<T>& rhs) {
+    const auto &ls = lhs.shape(), &rs = rhs.shape();
+    bool batched = ls.size() == 3;
+    if (ls.size() < 2 || ls.size() > 3 || rs.size() < 2 || rs.size() > ls.size() ||
+        ls[ls.size() - 1] != rs[rs.size() - 2] ||
+        (rs.size() == 3 && ls[0] != rs[0]))
+        runtimeError("can not multiply tensors of shape {} and {}", ls, rs);
+    size_t batch = batched ? ls[0] : 1, m = ls[ls.size() - 2], k = ls[ls.size() - 1],
+           n = rs[rs.size() - 1];
+    auto out = batched ? Tensor<T>({batch, m, n}) : Tensor<T>({m, n});
+
+    // first element and strides of the (row, column) dimensions of a batch
+    auto matrix = [](const Tensor<T>& t, size_t b) {
+        const auto& storage = t.storage();
+        size_t rank = t.shape().size();
+        Shape idx(rank, 0);
+        if (rank == 3) idx[0] = b;
+        return std::tuple{t.data() + storage.offset(idx), storage.strides[rank - 2],
+                          storage.strides[rank - 1]};
+    };
+    for (size_t b = 0; b < batch; b++) {
+        auto [a, rsa, csa] = matrix(lhs, b);
+        auto [w, rsw, csw] = matrix(rhs, b);
+        gemm::multiply(m, n, k, a, rsa, csa, w, rsw, csw, out.data() + b * m * n, n);
+    }
+    return out;
+}
+
+// Operations on whole tensors for `Variable<Tensor<T>>`, one tape node each (see
+// `Operation`). Element-wise arithmetic and math functions come from `Arithmetic`.
+template <typename T> struct TensorOp {
+    using Value = Tensor<T>;
+
+    // values on the tape own their elements: assigning to a view writes to its parent
+    static Value owned(Value x) {
+        if (x.storage().owning()) return x;
+        Value copy(x);
+        return copy;
+    }
+
+    struct MatMul {
+        static constexpr std::string_view name = "matmul";
+        static Value forward(const Value& a, const Value& b) { return matmul(a, b); }
+        static std::tuple<Value, Value> backward(const Value& diff, const Value& a,
+                                                 const Value& b) {
+            if (a.shape().size() == b.shape().size())
+                return {matmul(diff, b.transpose()), matmul(a.transpose(), diff)};
+            // `b` is shared by every batch of `a`: its gradient is summed over them
+            const auto &as = a.shape(), &ds = diff.shape();
+            Value rows = a.reshape({as[0] * as[1], as[2]});
+            return {matmul(diff, b.transpose()),
+                    matmul(rows.transpose(), diff.reshape({ds[0] * ds[1], ds[2]}))};
+        }
+    };
+
+    // sum and mean of all elements, as a one-element tensor whose gradient is broadcast
+    // back to the operand when it is accumulated (see `add_diff`)
+    struct Sum {
+        static constexpr std::string_view name = "sum";
+        static Value forward(const Value& x) { return Value(x.sum()); }
+        static Value backward(const Value& diff, const Value&) { return diff; }
+    };
+    struct Mean {
+        static constexpr std::string_view name = "mean";
+        static Value forward(const Value& x) { return Value(x.sum() / T(x.size())); }
+        static Value backward(const Value& diff, const Value& x) {
+            return Value(diff.item() / T(x.size()));
+        }
+    };
+
+    // gradient of a reduction along `axis`, spread back over the shape of `x`
+    static Value spread(const Value& diff, const Value& x, size_t axis) {
+        Shape keep = x.shape();
+        keep[axis] = 1;
+        return (diff.size() == 1 ? diff : diff.reshape(keep)).expand(x.shape());
+    }
+
+    // Reductions along an axis, which they carry with `keepdim` (see `Operation::make`).
+    struct SumAlong {
+        static constexpr std::string_view name = "sum";
+        size_t axis;
+        bool keepdim;
+        Value forward(const Value& x) const { return x.sum(axis, keepdim); }
+        Value backward(const Value& diff, const Value& x) const {
+            return spread(diff, x, axis);
+        }
+    };
+    struct MeanAlong {
+        static constexpr std::string_view name = "mean";
+        size_t axis;
+        bool keepdim;
+        Value forward(const Value& x) const { return x.mean(axis, keepdim); }
+        Value backward(const Value& diff, const Value& x) const {
+            return spread(diff, x, axis) * Value(T(1) / T(x.shape()[axis]));
+        }
+    };
+    // the gradient goes to the first of the largest elements, as for `argmax`
+    struct MaxAlong {
+        static constexpr std::string_view name = "max";
+        size_t axis;
+        bool keepdim;
+        Value forward(const Value& x) const { return x.max(axis, keepdim); }
+        Value backward(const Value& diff, const Value& x) const {
+            Shape line(x.shape().size(), 1);
+            line[axis] = x.shape()[axis];
+            Tensor<size_t> position(line);
+            std::iota(position.data(), position.data() + position.size(), size_t(0));
+            auto first = Tensor<size_t>::zip(std::equal_to<>(), position,
+                                             x.argmax(axis, true));
+            return where(
+                first, [&] { return spread(diff, x, axis); }, [] { return Value(T{}); });
+        }
+    };
+    struct NormAlong {
+        static constexpr std::string_view name = "norm";
+        size_t axis;
+        bool keepdim;
+        Value forward(const Value& x) const { return x.norm(axis, keepdim); }
+        // x / norm, and 0 where the norm is 0
+        Value backward(const Value& diff, const Value& x, const Value& out) const {
+            auto scale = where(
+                out > Value(T{}), [&] { return diff / out; }, [] { return Value(T{}); });
+            return x * spread(scale, x, axis);
+        }
+    };
+
+    struct Transpose {
+        static constexpr std::string_view name = "transpose";
+        static Value forward(const Value& x) { return owned(x.transpose()); }
+        static Value backward(const Value& diff, const Value&) {
+            return diff.transpose();
+        }
+    };
+
+    struct Reshape {
+        static constexpr std::string_view name = "reshape";
+        Shape shape;
+        Value forward(const Value& x) const { return owned(x.reshape(shape)); }
+        Value backward(const Value& diff, const Value& x) const {
+            return diff.reshape(x.shape());
+        }
+    };
+};
+
+template <typename T>
+Variable<Tensor<T>> matmul(const Variable<Tensor<T>>& a, const Variable<Tensor<T>>& b) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::MatMul{}, a, b);
+}
+template <typename T> Variable<Tensor<T>> sum(const Variable<Tensor<T>>& x) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::Sum{}, x);
+}
+template <typename T> Variable<Tensor<T>> mean(const Variable<Tensor<T>>& x) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::Mean{}, x);
+}
+template <typename T>
+Variable<Tensor<T>> sum(const Variable<Tensor<T>>& x, size_t axis,
+                        bool keepdim = false) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::SumAlong{axis, keepdim}, x);
+}
+template <typename T>
+Variable<Tensor<T>> mean(const Variable<Tensor<T>>& x, size_t axis,
+                         bool keepdim = false) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::MeanAlong{axis, keepdim}, x);
+}
+template <typename T>
+Variable<Tensor<T>> max(const Variable<Tensor<T>>& x, size_t axis,
+                        bool keepdim = false) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::MaxAlong{axis, keepdim}, x);
+}
+template <typename T>
+Variable<Tensor<T>> norm(const Variable<Tensor<T>>& x, size_t axis,
+                         bool keepdim = false) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::NormAlong{axis, keepdim}, x);
+}
+template <typename T> Variable<Tensor<T>> transpose(const Variable<Tensor<T>>& x) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::Transpose{}, x);
+}
+template <typename T>
+Variable<Tensor<T>> reshape(const Variable<Tensor<T>>& x, const Shape& shape) {
+    return Variable<Tensor<T>>(typename TensorOp<T>::Reshape{shape}, x);
+}
@@ -92,7 +92,7 @@ std::string serialize(const auto& val) {
     } else if constexpr (requires { std::to_string(val); }) {
         return std::to_string(val);
     } else if constexpr (requires { std::ostringstream() << val; }) {
-        static std::ostringstream oss;
+        static thread_local std::ostringstream oss;
         oss.str(""), oss.clear(), oss << val;
         return oss.str();
     } else {
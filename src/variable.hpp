@@ -5,8 +5,15 @@
 
 #include <cmath>
 #include <format>
+#include <type_traits>
 
-template <typename T> class Arithmetic : public Operation<T> {
+// `cond ? then() : otherwise()`, spelled so that formulas also work for value types
+// whose comparisons yield a per-lane mask (see `where` in lanes.hpp)
+template <typename F, typename G> auto where(bool cond, F&& then, G&& otherwise) {
+    return cond ? then() : otherwise();
+}
+
+template <typename T> class Arithmetic {
 public:
     // clang-format off
     enum class Type {
@@ -16,119 +23,114 @@ public:
         sqrt, power, abs
     };
     // clang-format on
-    Type type;
-    T backward(const T& diff, const T& arg) const override {
-        using namespace std;
-        auto coef = [&]() -> T {
-            switch (type) {
-                case Type::oppo: return -1;
-                case Type::sqrt: return 0.5 / sqrt(arg);
-                case Type::abs: return arg >= 0 ? 1 : -1;
-                case Type::log: return 1 / arg;
-                case Type::exp: return exp(arg);
-                case Type::sin: return cos(arg);
-                case Type::cos: return -sin(arg);
-                case Type::tan: return 1 / (cos(arg) * cos(arg));
-                case Type::asin: return 1 / sqrt(1 - arg * arg);
-                case Type::acos: return -1 / sqrt(1 - arg * arg);
-                case Type::atan: return 1 / (1 + arg * arg);
-                case Type::sinh: return cosh(arg);
-                case Type::cosh: return sinh(arg);
-                case Type::tanh: return 1 / (cosh(arg) * cosh(arg));
-                default:
-                    runtimeError("invalid func type {} for unary backward",
-                                 magic_enum::enum_name(type));
-            }
-        }();
-        return coef * diff;
+    static constexpr bool binary(Type type) {
+        return type == Type::add || type == Type::sub || type == Type::mul ||
+               type == Type::div || type == Type::power;
     }
-    T forward(const T& arg) const override {
-        using namespace std;
-        switch (type) {
-            case Type::oppo: return -arg;
-            case Type::sqrt: return sqrt(arg);
-            case Type::abs: return abs(arg);
-            case Type::log: return log(arg);
-            case Type::exp: return exp(arg);
-            case Type::sin: return sin(arg);
-            case Type::cos: return cos(arg);
-            case Type::tan: return tan(arg);
-            case Type::asin: return asin(arg);
-            case Type::acos: return acos(arg);
-            case Type::atan: return atan(arg);
-            case Type::sinh: return sinh(arg);
-            case Type::cosh: return cosh(arg);
-            case Type::tanh: return tanh(arg);
-            default:
-                runtimeError("invalid func type {} for unary forward",
-                             magic_enum::enum_name(type));
+
+    // one operation, resolved at compile time (see `Operation`)
+    // clang-format off
+    template <Type type> struct Op {
+        static constexpr std::string_view name = magic_enum::enum_name(type);
+
+        static T forward(const T& arg)
+            requires(!binary(type))
+        {
+            using namespace std;
+            if constexpr (type == Type::oppo) return -arg;
+            else if constexpr (type == Type::sqrt) return sqrt(arg);
+            else if constexpr (type == Type::abs) return abs(arg);
+            else if constexpr (type == Type::log) return log(arg);
+            else if constexpr (type == Type::exp) return exp(arg);
+            else if constexpr (type == Type::sin) return sin(arg);
+            else if constexpr (type == Type::cos) return cos(arg);
+            else if constexpr (type == Type::tan) return tan(arg);
+            else if constexpr (type == Type::asin) return asin(arg);
+            else if constexpr (type == Type::acos) return acos(arg);
+            else if constexpr (type == Type::atan) return atan(arg);
+            else if constexpr (type == Type::sinh) return sinh(arg);
+            else if constexpr (type == Type::cosh) return cosh(arg);
+            else if constexpr (type == Type::tanh) return tanh(arg);
+            else static_assert(false, "invalid func type for unary forward");
         }
-    }
-    std::tuple<T, T> backward(const T& diff, const T& lhs, const T& rhs) const override {
-        using namespace std;
-        auto [coef_l, coef_r] = [&]() -> std::tuple<T, T> {
-            switch (type) {
-                case Type::add: return {1, 1};
-                case Type::sub: return {1, -1};
-                case Type::mul: return {rhs, lhs};
-                case Type::div: return {1 / rhs, -lhs / (rhs * rhs)};
-                case Type::power:
-                    return {rhs * pow(lhs, rhs - 1), pow(lhs, rhs) * log(lhs)};
-                default:
-                    runtimeError("invalid func type {} for binary backward",
-                                 magic_enum::enum_name(type));
-            }
-        }();
-        return {coef_l * diff, coef_r * diff};
-    }
-    T forward(const T& lhs, const T& rhs) const override {
-        using namespace std;
-        switch (type) {
-            case Type::add: return lhs + rhs;
-            case Type::sub: return lhs - rhs;
-            case Type::mul: return lhs * rhs;
-            case Type::div: return lhs / rhs;
-            case Type::power: return pow(lhs, rhs);
-            default:
-                runtimeError("invalid func type {} for binary forward",
-                             magic_enum::enum_name(type));
+        static T backward(const T& diff, const T& arg, const T& out)
+            requires(!binary(type))
+        {
+            using namespace std;
+            auto coef = [&]() -> T {
+                if constexpr (type == Type::oppo) return -1;
+                else if constexpr (type == Type::sqrt) return 0.5 / out;
+                else if constexpr (type == Type::abs)
+                    return where(arg >= 0, [] { return T(1); }, [] { return T(-1); });
+                else if constexpr (type == Type::log) return 1 / arg;
+                else if constexpr (type == Type::exp) return out;
+                else if constexpr (type == Type::sin) return cos(arg);
+                else if constexpr (type == Type::cos) return -sin(arg);
+                else if constexpr (type == Type::tan) return 1 / (cos(arg) * cos(arg));
+                else if constexpr (type == Type::asin) return 1 / sqrt(1 - arg * arg);
+                else if constexpr (type == Type::acos) return -1 / sqrt(1 - arg * arg);
+                else if constexpr (type == Type::atan) return 1 / (1 + arg * arg);
+                else if constexpr (type == Type::sinh) return cosh(arg);
+                else if constexpr (type == Type::cosh) return sinh(arg);
+                else if constexpr (type == Type::tanh) return 1 - out * out;
+                else static_assert(false, "invalid func type for unary backward");
+            }();
+            return coef * diff;
         }
-    }
-    Arithmetic(Type type) : type(type) {
-        switch (type) {
-            case Type::add:
-            case Type::sub:
-            case Type::mul:
-            case Type::div:
-            case Type::power: this->op_type = Operation<T>::OpType::binary; break;
-            default: this->op_type = Operation<T>::OpType::unary; break;
+        static T forward(const T& lhs, const T& rhs)
+            requires(binary(type))
+        {
+            using namespace std;
+            if constexpr (type == Type::add) return lhs + rhs;
+            else if constexpr (type == Type::sub) return lhs - rhs;
+            else if constexpr (type == Type::mul) return lhs * rhs;
+            else if constexpr (type == Type::div) return lhs / rhs;
+            else if constexpr (type == Type::power) return pow(lhs, rhs);
+            else static_assert(false, "invalid func type for binary forward");
         }
-    }
-    std::string_view name() const override { return magic_enum::enum_name(type); }
-};
-
-template <typename T> class ArithmeticFuncTable {
-public:
-    std::map<typename Arithmetic<T>::Type, Arithmetic<T>> content;
-    ArithmeticFuncTable() {
-        const auto types = magic_enum::enum_values<typename Arithmetic<T>::Type>();
-        for (const auto& type : types) {
-            content.emplace(type, Arithmetic<T>(type));
+        static std::tuple<T, T> backward(const T& diff, const T& lhs, const T& rhs,
+                                         const T& out)
+            requires(binary(type))
+        {
+            using namespace std;
+            auto [coef_l, coef_r] = [&]() -> std::tuple<T, T> {
+                if constexpr (type == Type::add) return {1, 1};
+                else if constexpr (type == Type::sub) return {1, -1};
+                else if constexpr (type == Type::mul) return {rhs, lhs};
+                else if constexpr (type == Type::div)
+                    return {1 / rhs, -lhs / (rhs * rhs)};
+                // `abs(lhs) > 0` rather than `lhs != 0`, which compares whole tensors
+                else if constexpr (type == Type::power)
+                    return {where(abs(lhs) > 0, [&] { return T(rhs * out / lhs); },
+                                  [&] { return T(rhs * pow(lhs, rhs - 1)); }),
+                            out * log(lhs)};
+                else static_assert(false, "invalid func type for binary backward");
+            }();
+            return {coef_l * diff, coef_r * diff};
         }
-    }
-    Arithmetic<T>* operator()(Arithmetic<T>::Type type) { return &content.at(type); }
+    };
+    // clang-format on
 };
 
-template <typename T> ArithmeticFuncTable<T> func_table;
-
 template <typename T> class Variable : public AutoDiff<T> {
+    using Type = Arithmetic<T>::Type;
+
 public:
     T initial_diff() const override { return 1; }
 
-    Variable(T value = 0) : AutoDiff<T>(value) {}
+    Variable(T value = T{}) : AutoDiff<T>(std::move(value)) {}
+    // scalar constants next to variables of a composite value type, e.g. `1 + x`
+    template <typename S>
+        requires(std::is_arithmetic_v<S> && !std::is_arithmetic_v<T>)
+    Variable(S value) : AutoDiff<T>(T(value)) {}
 
-    Variable(Arithmetic<T>::Type type, const auto&... args)
-        : AutoDiff<T>(func_table<T>(type), args...) {}
+    template <typename Op>
+        requires requires { Op::name; }
+    Variable(Op op, const auto&... args) : AutoDiff<T>(std::move(op), args...) {}
+
+    template <Type type> static Variable apply(const auto&... args) {
+        return Variable(typename Arithmetic<T>::template Op<type>{}, args...);
+    }
 
     bool operator==(const Variable& other) const {
         return abs(this->raw() - other.raw()) < 1e-10;
@@ -137,67 +139,39 @@ public:
 
     friend Variable operator+(const Variable& v) { return Variable(v); }
     friend Variable operator+(const Variable& a, const Variable& b) {
-        return Variable(Arithmetic<T>::Type::add, a, b);
-    }
-    friend Variable operator-(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::oppo, v);
+        return apply<Type::add>(a, b);
     }
+    friend Variable operator-(const Variable& v) { return apply<Type::oppo>(v); }
     friend Variable operator-(const Variable& a, const Variable& b) {
-        return Variable(Arithmetic<T>::Type::sub, a, b);
+        return apply<Type::sub>(a, b);
     }
     friend Variable operator*(const Variable& a, const Variable& b) {
-        return Variable(Arithmetic<T>::Type::mul, a, b);
+        return apply<Type::mul>(a, b);
     }
     friend Variable operator/(const Variable& a, const Variable& b) {
-        return Variable(Arithmetic<T>::Type::div, a, b);
+        return apply<Type::div>(a, b);
     }
     friend Variable operator^(const Variable& a, const Variable& b) { return pow(a, b); }
     friend Variable operator+=(const Variable& a, const Variable& b) { a = a + b; }
     friend Variable operator-=(const Variable& a, const Variable& b) { a = a - b; }
     friend Variable operator*=(const Variable& a, const Variable& b) { a = a * b; }
     friend Variable operator/=(const Variable& a, const Variable& b) { a = a / b; }
-    friend Variable log(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::log, v);
-    }
-    friend Variable sin(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::sin, v);
-    }
-    friend Variable cos(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::cos, v);
-    }
-    friend Variable tan(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::tan, v);
-    }
-    friend Variable exp(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::exp, v);
-    }
-    friend Variable sqrt(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::sqrt, v);
-    }
-    friend Variable asin(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::asin, v);
-    }
-    friend Variable acos(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::acos, v);
-    }
-    friend Variable atan(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::atan, v);
-    }
+    friend Variable log(const Variable& v) { return apply<Type::log>(v); }
+    friend Variable sin(const Variable& v) { return apply<Type::sin>(v); }
+    friend Variable cos(const Variable& v) { return apply<Type::cos>(v); }
+    friend Variable tan(const Variable& v) { return apply<Type::tan>(v); }
+    friend Variable exp(const Variable& v) { return apply<Type::exp>(v); }
+    friend Variable sqrt(const Variable& v) { return apply<Type::sqrt>(v); }
+    friend Variable asin(const Variable& v) { return apply<Type::asin>(v); }
+    friend Variable acos(const Variable& v) { return apply<Type::acos>(v); }
+    friend Variable atan(const Variable& v) { return apply<Type::atan>(v); }
     friend Variable pow(const Variable& a, const Variable& b) {
-        return Variable(Arithmetic<T>::Type::power, a, b);
-    }
-    friend Variable sinh(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::sinh, v);
-    }
-    friend Variable cosh(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::cosh, v);
-    }
-    friend Variable tanh(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::tanh, v);
-    }
-    friend Variable abs(const Variable& v) {
-        return Variable(Arithmetic<T>::Type::abs, v);
+        return apply<Type::power>(a, b);
     }
+    friend Variable sinh(const Variable& v) { return apply<Type::sinh>(v); }
+    friend Variable cosh(const Variable& v) { return apply<Type::cosh>(v); }
+    friend Variable tanh(const Variable& v) { return apply<Type::tanh>(v); }
+    friend Variable abs(const Variable& v) { return apply<Type::abs>(v); }
 };
 
 template <typename T> Variable<T> max(const Variable<T>& a, const Variable<T>& b) {
@@ -211,7 +185,7 @@ template <typename T> Variable<T> min(const Variable<T>& a, const Variable<T>& b
 
 using var = Variable<double>;
 
-template <typename... Args> void clear(Args... v) { (v.clear(), ...); }
+template <typename... Args> void clear(const Args&... v) { (v.clear(), ...); }
 
 template <typename T> struct std::formatter<Variable<T>> : std::formatter<T> {
     auto format(const Variable<T>& v, std::format_context& ctx) const {